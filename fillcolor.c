@@ -1,28 +1,26 @@
 // Send a fullcolor pattern to
 // ledpanel rgb_buffer 
+// or any other sink from ledpanel.h, e.g. -o emu
 
 #include <stdio.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
+#include "ledpanel.h"
 
 #define MAXBUFFER_PER_PANEL 32*32*3
-#define OUT_FILE "/sys/class/ledpanel/rgb_buffer"
-//#define OUT_FILE "/root/out_buffer"
 
 #define LEFT_SHIFT 5
 
+char *out_spec=NULL;	// -o, or LEDPANEL
+
 // Write on rgb_buffer the buffer content
 void WriteBuffer(unsigned char *buffer) {
-	int fd;
+	struct ledpanel *out;
 
-	if ((fd=open(OUT_FILE,O_WRONLY))<0) {
+	if (!(out=ledpanel_open(out_spec))) {
 		printf("open() error\n");
 		return;
 	}
-	write(fd,buffer,MAXBUFFER_PER_PANEL);
-	close(fd);
+	ledpanel_write(out,buffer,MAXBUFFER_PER_PANEL);
+	ledpanel_close(out);
 }
 
 // Fill the buffer with a rgb color
@@ -41,8 +39,24 @@ void main(int argc, char *argv[]) {
 	int i,r,g,b;
 	unsigned char buffer[MAXBUFFER_PER_PANEL];
 
+	char *prog=argv[0];
+
+	if (argc>1 && !strcmp(argv[1],"-o")) {
+		if (argc<3) {
+			printf("%s: -o needs a sink, see ledpanel.h\n",prog);
+			return;
+		}
+		out_spec=argv[2];
+		argv+=2;
+		argc-=2;
+	}
+	for (i=1;i<argc;i++)
+		if (!strcmp(argv[i],"-o")) {
+			printf("%s: -o goes before r g b\n",prog);
+			argc=0;
+		}
     if (argc!=4) {
-        printf( "Use: %s r g b\n", argv[0] );
+        printf( "Use: %s [-o out] r g b\n", prog );
     } else {
 		r=atoi(argv[1]);
 		g=atoi(argv[2]);
@@ -0,0 +1,56 @@
+#!/usr/bin/python
+# Test pattern for measuring how long a change on the X server takes to
+# reach the led panel through vnc_tiny_view.
+#
+# Place it under the view of vnc_tiny_view, same geometry:
+#   python latency_probe.py 320x240+0+0 &
+#   VNC_TINY_VIEW=320x240+0+0 VNC_TINY_PROBE=100 vnc_tiny_view HOST
+#
+# A 4x4 grid shows the wall clock in ms (16 bits), one bit per cell:
+# red is the bit, green the same bit of a hash (a torn frame fails it),
+# blue the inverse of red (a cell blended by scaling is ignored).
+# Both hosts need synchronized clocks (ntp), or run everything on one host.
+
+import sys
+import time
+try:
+	import Tkinter as tk
+except ImportError:
+	import tkinter as tk
+
+if len(sys.argv)<2 or len(sys.argv)>3:
+	print("Syntax:")
+	print("  %s WxH+X+Y [ms_per_frame]" % (sys.argv[0]))
+	quit()
+
+geometry=sys.argv[1]
+period=int(sys.argv[2]) if len(sys.argv)==3 else 50
+w,h=[int(v) for v in geometry.split("+")[0].split("x")]
+
+def probe_hash(ts):
+	return (ts*40503) & 0xffff
+
+root=tk.Tk()
+root.overrideredirect(1)
+root.geometry(geometry)
+canvas=tk.Canvas(root,width=w,height=h,highlightthickness=0,bg="black")
+canvas.pack()
+
+cells=[]
+for i in range(16):
+	x=(i%4)*w//4
+	y=(i//4)*h//4
+	cells.append(canvas.create_rectangle(x,y,(i%4+1)*w//4,(i//4+1)*h//4,width=0))
+
+def draw():
+	ts=int(time.time()*1000) & 0xffff
+	hs=probe_hash(ts)
+	for i in range(16):
+		r=(ts>>i)&1
+		g=(hs>>i)&1
+		canvas.itemconfig(cells[i],fill="#%02x%02x%02x" % (255*r,255*g,255*(1-r)))
+	root.update_idletasks()
+	root.after(period,draw)
+
+draw()
+root.mainloop()
@@ -0,0 +1,343 @@
+// Output sinks for ledpanel frames, shared by fillcolor, playlist and
+// vnc_tiny_view.
+//
+// The sink is chosen with -o SPEC or LEDPANEL=SPEC, default OUT_FILE:
+//
+//   /sys/class/ledpanel/rgb_buffer   an existing device or file, rewritten in place
+//   file:PATH                        appends timestamped frames, - is stdout
+//   pipe:CMD                         the same, into popen(CMD)
+//   shm:/dev/shm/ledpanel            the latest frame in a shared mapping
+//   emu[:HZ[,US]]                    no output, models a panel scanning out at
+//                                    HZ (100) that takes US (1000) per write
+//   null                             no output at all
+//
+// A timestamped frame is a struct ledpanel_frame followed by size bytes.
+// The shared mapping starts with the same header; seq is odd while a frame
+// is being written, so a reader retries until it reads the same even seq
+// before and after copying.
+// The emulator prints frames, drops and write-to-visible latency to stderr
+// every 10 seconds and on close.
+//
+// LEDPANEL_POWER=40 limits any sink to 40% of the current of an all white
+// panel. The load is the sum of the shown levels (top 3 bits) of all
+// channels, kept up to date from the changed rectangle only. Over budget,
+// the frame is scaled through a LUT. The scale drops at once, so the budget
+// holds on every frame, and recovers within LEDPANEL_RECOVER_MS to avoid
+// flicker; producers that may sit on a dimmed frame call ledpanel_flush().
+
+#ifndef LEDPANEL_H
+#define LEDPANEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#ifndef OUT_FILE
+#define OUT_FILE "/sys/class/ledpanel/rgb_buffer"
+//#define OUT_FILE "/root/out_buffer"
+#endif
+
+#define LEDPANEL_DEVICE	0
+#define LEDPANEL_FILE	1
+#define LEDPANEL_SHM	2
+#define LEDPANEL_EMU	3
+#define LEDPANEL_NULL	4
+
+#define LEDPANEL_LEVEL(v)	((v)>>5)	// the panel shows 8 levels
+#define LEDPANEL_RECOVER_MS	100		// from black to full brightness
+
+struct ledpanel_frame {
+	char magic[4];		// "LEDP"
+	uint32_t seq;		// frames written so far
+	uint32_t size;		// bytes of rgb data
+	uint32_t reserved;
+	uint64_t usec;		// CLOCK_MONOTONIC when the frame was written
+};
+
+struct ledpanel {
+	int type;
+	int fd;
+	FILE *pipe;
+	uint32_t seq;
+	struct ledpanel_frame *shm;	// header, then the frame
+	int shm_size;
+	// emulator
+	long long period, latency;	// usec
+	long long start, visible, report;
+	long frames, dropped, reported;
+	long long lat_sum, lat_max;
+	// power limiter
+	int power;		// percent of all white, 0: off
+	unsigned char *last;	// last frame written, unscaled
+	int last_size;
+	long load;		// sum of LEDPANEL_LEVEL() over last
+	int scale;		// 256: full brightness
+	int target;		// what the load allows
+	long long scale_usec;	// when scale last moved up
+	int lut_scale;
+	unsigned char lut[256];
+	unsigned char *out;	// scaled frame
+	long limited;		// frames scaled down
+};
+
+static inline long long ledpanel_usec(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000000LL+t.tv_nsec/1000;
+}
+
+static inline void ledpanel_sleep(long long usec) {
+	struct timespec t;
+
+	t.tv_sec=usec/1000000;
+	t.tv_nsec=(usec%1000000)*1000;
+	while (nanosleep(&t,&t)!=0)
+		;
+}
+
+static inline void ledpanel_report(struct ledpanel *p, long long now) {
+	long n=p->frames-p->reported;
+	long long us=now-p->report;
+
+	if (!p->frames)
+		return;
+	fprintf(stderr,"ledpanel emu: %ld frames, %.1f fps, %ld dropped, latency avg %lld max %lld usec",
+		p->frames,us>0 ? n*1e6/us : 0.0,p->dropped,p->lat_sum/p->frames,p->lat_max);
+	if (p->power)
+		fprintf(stderr,", %ld limited, now %d%%",p->limited,p->scale*100/256);
+	fprintf(stderr,"\n");
+	p->reported=p->frames;
+	p->report=now;
+}
+
+// spec NULL: LEDPANEL or OUT_FILE. Returns NULL if the sink cannot be opened.
+static inline struct ledpanel *ledpanel_open(const char *spec) {
+	struct ledpanel *p=calloc(1,sizeof(struct ledpanel));
+
+	if (!spec || !*spec)
+		spec=getenv("LEDPANEL");
+	if (!spec || !*spec)
+		spec=OUT_FILE;
+	p->fd=-1;
+	p->scale=p->target=p->lut_scale=256;
+	if (getenv("LEDPANEL_POWER"))
+		p->power=atoi(getenv("LEDPANEL_POWER"));
+	if (p->power<=0 || p->power>=100)
+		p->power=0;
+	if (!strncmp(spec,"file:",5)) {
+		p->type=LEDPANEL_FILE;
+		p->fd=strcmp(spec+5,"-") ? open(spec+5,O_WRONLY|O_CREAT|O_TRUNC,0644) : 1;
+	} else if (!strncmp(spec,"pipe:",5)) {
+		p->type=LEDPANEL_FILE;
+		if ((p->pipe=popen(spec+5,"w")))
+			p->fd=fileno(p->pipe);
+	} else if (!strncmp(spec,"shm:",4)) {
+		p->type=LEDPANEL_SHM;
+		p->fd=open(spec+4,O_RDWR|O_CREAT,0644);
+	} else if (!strcmp(spec,"null")) {
+		p->type=LEDPANEL_NULL;
+		return p;
+	} else if (!strncmp(spec,"emu",3)) {
+		int hz=100, us=1000;
+
+		sscanf(spec+3,":%d,%d",&hz,&us);
+		p->type=LEDPANEL_EMU;
+		p->period=1000000/(hz>0 ? hz : 1);
+		p->latency=us;
+		p->start=p->report=ledpanel_usec();
+		return p;
+	} else {
+		p->type=LEDPANEL_DEVICE;
+		p->fd=open(spec,O_WRONLY);	// a typo must not become a regular file, see file:
+	}
+	if (p->fd<0) {
+		perror(spec);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+static inline int ledpanel_write_shm(struct ledpanel *p, const unsigned char *buffer, int size) {
+	int len=sizeof(struct ledpanel_frame)+size;
+
+	if (p->shm_size!=len) {
+		if (p->shm)
+			munmap(p->shm,p->shm_size);
+		p->shm_size=0;
+		if (ftruncate(p->fd,len)<0 ||
+		    (p->shm=mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,p->fd,0))==MAP_FAILED) {
+			p->shm=NULL;
+			return -1;
+		}
+		p->shm_size=len;
+		memcpy(p->shm->magic,"LEDP",4);
+	}
+	p->shm->seq=2*p->seq-1;
+	__sync_synchronize();
+	p->shm->size=size;
+	p->shm->usec=ledpanel_usec();
+	memcpy(p->shm+1,buffer,size);
+	__sync_synchronize();
+	p->shm->seq=2*p->seq;
+	return size;
+}
+
+// A frame written now is visible from the next scan out after the write
+// completed. A frame replaced before its scan out was never seen.
+static inline int ledpanel_write_emu(struct ledpanel *p, const unsigned char *buffer, int size) {
+	long long t0=ledpanel_usec(), t1;
+
+	if (p->latency>0)
+		ledpanel_sleep(p->latency);
+	t1=ledpanel_usec();
+	if (p->frames && p->visible>t1)
+		p->dropped++;
+	p->visible=p->start+((t1-p->start)/p->period+1)*p->period;
+	p->lat_sum+=p->visible-t0;
+	if (p->visible-t0>p->lat_max)
+		p->lat_max=p->visible-t0;
+	p->frames++;
+	if (t1-p->report>=10000000)
+		ledpanel_report(p,t1);
+	return size;
+}
+
+static inline int ledpanel_output(struct ledpanel *p, const unsigned char *buffer, int size) {
+	struct ledpanel_frame f;
+
+	p->seq++;
+	switch (p->type) {
+	case LEDPANEL_DEVICE:
+		lseek(p->fd,0,SEEK_SET);
+		return write(p->fd,buffer,size)==size ? size : -1;
+	case LEDPANEL_FILE:
+		memcpy(f.magic,"LEDP",4);
+		f.seq=p->seq;
+		f.size=size;
+		f.reserved=0;
+		f.usec=ledpanel_usec();
+		if (write(p->fd,&f,sizeof(f))!=sizeof(f))
+			return -1;
+		return write(p->fd,buffer,size)==size ? size : -1;
+	case LEDPANEL_SHM:
+		return ledpanel_write_shm(p,buffer,size);
+	case LEDPANEL_EMU:
+		return ledpanel_write_emu(p,buffer,size);
+	case LEDPANEL_NULL:
+		return size;
+	}
+	return -1;
+}
+
+static inline void ledpanel_scale(struct ledpanel *p, long long now) {
+	long long up=256*(now-p->scale_usec)/(LEDPANEL_RECOVER_MS*1000);
+
+	if (p->target<=p->scale) {
+		p->scale=p->target;
+		p->scale_usec=now;
+	} else if (up>0) {
+		p->scale=p->scale+up<p->target ? p->scale+up : p->target;
+		p->scale_usec=now;
+	}
+}
+
+static inline const unsigned char *ledpanel_scaled(struct ledpanel *p, const unsigned char *buffer, int size) {
+	int i;
+
+	if (p->scale>=256)
+		return buffer;
+	if (p->lut_scale!=p->scale) {
+		// scale the shown level, rounded down, so the budget holds.
+		for (i=0;i<256;i++)
+			p->lut[i]=(LEDPANEL_LEVEL(i)*p->scale>>8)<<5;
+		p->lut_scale=p->scale;
+	}
+	for (i=0;i<size;i++)
+		p->out[i]=p->lut[buffer[i]];
+	p->limited++;
+	return p->out;
+}
+
+// Only the w x h pixels at x,y (stride bytes per row) changed since the
+// last write, update the load from them and return the frame to show.
+static inline const unsigned char *ledpanel_limit(struct ledpanel *p, const unsigned char *buffer, int size,
+						  int stride, int x, int y, int w, int h) {
+	long limit=(long)size*LEDPANEL_LEVEL(255)*p->power/100;
+	int i;
+
+	if (p->last_size!=size) {
+		free(p->last);
+		free(p->out);
+		p->last=calloc(1,size);
+		p->out=malloc(size);
+		p->last_size=size;
+		p->load=0;
+		stride=size;		// everything changed
+		x=y=0;
+		w=size/3;
+		h=1;
+	}
+	for (; h>0; h--, y++) {
+		const unsigned char *s=buffer+y*stride+3*x;
+		unsigned char *d=p->last+y*stride+3*x;
+
+		for (i=0;i<3*w;i++) {
+			p->load+=LEDPANEL_LEVEL(s[i])-LEDPANEL_LEVEL(d[i]);
+			d[i]=s[i];
+		}
+	}
+
+	p->target=p->load>limit ? limit*256/p->load : 256;
+	ledpanel_scale(p,ledpanel_usec());
+	return ledpanel_scaled(p,buffer,size);
+}
+
+// Like ledpanel_write(), when only a rectangle of the frame changed.
+static inline int ledpanel_write_dirty(struct ledpanel *p, const unsigned char *buffer, int size,
+				       int stride, int x, int y, int w, int h) {
+	if (p->power)
+		buffer=ledpanel_limit(p,buffer,size,stride,x,y,w,h);
+	return ledpanel_output(p,buffer,size);
+}
+
+// Returns size, or -1 on error.
+static inline int ledpanel_write(struct ledpanel *p, const unsigned char *buffer, int size) {
+	return ledpanel_write_dirty(p,buffer,size,size,0,0,size/3,1);
+}
+
+// Writes the last frame again while the limiter recovers from a dimmed
+// frame. Returns nonzero while there is more to recover.
+static inline int ledpanel_flush(struct ledpanel *p) {
+	if (!p || !p->power || p->scale>=p->target)
+		return 0;
+	ledpanel_scale(p,ledpanel_usec());
+	ledpanel_output(p,ledpanel_scaled(p,p->last,p->last_size),p->last_size);
+	return p->scale<p->target;
+}
+
+static inline void ledpanel_close(struct ledpanel *p) {
+	if (!p)
+		return;
+	if (p->type==LEDPANEL_EMU)
+		ledpanel_report(p,ledpanel_usec());
+	if (p->shm)
+		munmap(p->shm,p->shm_size);
+	free(p->last);
+	free(p->out);
+	if (p->pipe)
+		pclose(p->pipe);
+	else if (p->fd>2)
+		close(p->fd);
+	free(p);
+}
+
+#endif
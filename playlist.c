@@ -0,0 +1,297 @@
+// Play a list of stills, animations, color fills and scrolling text
+// on the ledpanel rgb_buffer, with optional crossfades.
+//
+// All frames are loaded and converted to the panel format before the
+// first one is shown, the panel stays open, and every frame is written
+// at an absolute deadline, so timing does not drift.
+//
+// Playlist syntax, one item per line, times in seconds:
+//
+//   fade 0.5                 crossfade into the following items (0: cut)
+//   image icons/tux.rgb 5    a still
+//   anim fire 0.1 10         a directory of *.rgb frames, per frame, total
+//   fill 7 0 0 2             r g b 0..7 like fillcolor
+//   text 7 7 0 0.04 Hello    r g b, per pixel of scrolling, the text
+//
+// Output goes to -o SPEC or LEDPANEL, see ledpanel.h.
+//
+// Build: cc -Wall -O2 -o playlist playlist.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include "ledpanel.h"
+
+#define MAXBUFFER_PER_PANEL 32*32*3
+
+#define LEFT_SHIFT 5
+#define PANEL_MASK 0xe0		// the panel shows the top 3 bits of each color
+
+#define FADE_STEP_MS 40		// 25 crossfade frames per second
+#define MAX_ITEMS 256
+
+struct item {
+	int n;			// frames
+	unsigned char *frames;	// n * MAXBUFFER_PER_PANEL, in panel format
+	int frame_ms;
+	int ms;			// how long the item stays
+	int fade_ms;		// crossfade from the previous item
+};
+
+// 5x8 font, one byte per column, lsb on top, for ' ' .. '~'
+static const unsigned char font5x8[95][5] = {
+	{0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7F,0x14,0x7F,0x14},
+	{0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62}, {0x36,0x49,0x56,0x20,0x50}, {0x00,0x08,0x07,0x03,0x00},
+	{0x00,0x1C,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1C,0x00}, {0x2A,0x1C,0x7F,0x1C,0x2A}, {0x08,0x08,0x3E,0x08,0x08},
+	{0x00,0x80,0x70,0x30,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x00,0x60,0x60,0x00}, {0x20,0x10,0x08,0x04,0x02},
+	{0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00}, {0x72,0x49,0x49,0x49,0x46}, {0x21,0x41,0x49,0x4D,0x33},
+	{0x18,0x14,0x12,0x7F,0x10}, {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x31}, {0x41,0x21,0x11,0x09,0x07},
+	{0x36,0x49,0x49,0x49,0x36}, {0x46,0x49,0x49,0x29,0x1E}, {0x00,0x00,0x14,0x00,0x00}, {0x00,0x40,0x34,0x00,0x00},
+	{0x00,0x08,0x14,0x22,0x41}, {0x14,0x14,0x14,0x14,0x14}, {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x59,0x09,0x06},
+	{0x3E,0x41,0x5D,0x59,0x4E}, {0x7C,0x12,0x11,0x12,0x7C}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22},
+	{0x7F,0x41,0x41,0x41,0x3E}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x09,0x01}, {0x3E,0x41,0x41,0x51,0x73},
+	{0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00}, {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41},
+	{0x7F,0x40,0x40,0x40,0x40}, {0x7F,0x02,0x1C,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E},
+	{0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46}, {0x26,0x49,0x49,0x49,0x32},
+	{0x03,0x01,0x7F,0x01,0x03}, {0x3F,0x40,0x40,0x40,0x3F}, {0x1F,0x20,0x40,0x20,0x1F}, {0x3F,0x40,0x38,0x40,0x3F},
+	{0x63,0x14,0x08,0x14,0x63}, {0x03,0x04,0x78,0x04,0x03}, {0x61,0x59,0x49,0x4D,0x43}, {0x00,0x7F,0x41,0x41,0x41},
+	{0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x41,0x7F}, {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40},
+	{0x00,0x03,0x07,0x08,0x00}, {0x20,0x54,0x54,0x78,0x40}, {0x7F,0x28,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x28},
+	{0x38,0x44,0x44,0x28,0x7F}, {0x38,0x54,0x54,0x54,0x18}, {0x00,0x08,0x7E,0x09,0x02}, {0x18,0xA4,0xA4,0x9C,0x78},
+	{0x7F,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7D,0x40,0x00}, {0x20,0x40,0x40,0x3D,0x00}, {0x7F,0x10,0x28,0x44,0x00},
+	{0x00,0x41,0x7F,0x40,0x00}, {0x7C,0x04,0x78,0x04,0x78}, {0x7C,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38},
+	{0xFC,0x18,0x24,0x24,0x18}, {0x18,0x24,0x24,0x18,0xFC}, {0x7C,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x24},
+	{0x04,0x04,0x3F,0x44,0x24}, {0x3C,0x40,0x40,0x20,0x7C}, {0x1C,0x20,0x40,0x20,0x1C}, {0x3C,0x40,0x30,0x40,0x3C},
+	{0x44,0x28,0x10,0x28,0x44}, {0x4C,0x90,0x90,0x90,0x7C}, {0x44,0x64,0x54,0x4C,0x44}, {0x00,0x08,0x36,0x41,0x00},
+	{0x00,0x00,0x77,0x00,0x00}, {0x00,0x41,0x36,0x08,0x00}, {0x02,0x01,0x02,0x04,0x02},
+};
+
+// Read a 32x32 rgb file and convert it to the panel format
+int load_rgb(char *fname, unsigned char *buffer) {
+	int fd, i, n;
+
+	if ((fd=open(fname,O_RDONLY))<0) {
+		perror(fname);
+		return 0;
+	}
+	n=read(fd,buffer,MAXBUFFER_PER_PANEL);
+	close(fd);
+	if (n!=MAXBUFFER_PER_PANEL) {
+		printf("%s: not a 32x32 rgb file\n",fname);
+		return 0;
+	}
+	for (i=0;i<MAXBUFFER_PER_PANEL;i++)
+		buffer[i]&=PANEL_MASK;
+	return 1;
+}
+
+int load_image(struct item *it, char *fname) {
+	it->frames=malloc(MAXBUFFER_PER_PANEL);
+	if (!load_rgb(fname,it->frames))
+		return 0;
+	it->n=1;
+	it->frame_ms=it->ms;
+	return 1;
+}
+
+int load_anim(struct item *it, char *dir) {
+	char pattern[1024];
+	glob_t g;
+	int i;
+
+	snprintf(pattern,sizeof(pattern),"%s/*.rgb",dir);
+	if (glob(pattern,0,NULL,&g)!=0) {
+		printf("%s: no *.rgb frames\n",dir);
+		return 0;
+	}
+	it->frames=malloc(g.gl_pathc*MAXBUFFER_PER_PANEL);
+	it->n=0;
+	for (i=0;i<g.gl_pathc;i++)
+		if (load_rgb(g.gl_pathv[i],it->frames+it->n*MAXBUFFER_PER_PANEL))
+			it->n++;
+	globfree(&g);
+	return it->n>0;
+}
+
+void fill_full(unsigned char r,unsigned char g,unsigned char b,unsigned char *buffer) {
+	int i;
+
+	for (i=0;i<MAXBUFFER_PER_PANEL;i+=3) {
+		buffer[i+0]=(r<<LEFT_SHIFT);
+		buffer[i+1]=(g<<LEFT_SHIFT);
+		buffer[i+2]=(b<<LEFT_SHIFT);
+	}
+}
+
+int load_fill(struct item *it, int r, int g, int b) {
+	it->frames=malloc(MAXBUFFER_PER_PANEL);
+	fill_full(r,g,b,it->frames);
+	it->n=1;
+	it->frame_ms=it->ms;
+	return 1;
+}
+
+// One frame per pixel of scrolling, from entering right to leaving left
+int load_text(struct item *it, int r, int g, int b, char *text) {
+	int len=strlen(text);
+	int width=6*len;
+	int f, x, y;
+
+	it->n=width+32;
+	it->frames=calloc(it->n,MAXBUFFER_PER_PANEL);
+	for (f=0;f<it->n;f++) {
+		unsigned char *buffer=it->frames+f*MAXBUFFER_PER_PANEL;
+		for (x=0;x<32;x++) {
+			int col=x+f-32;		// column within the text
+			unsigned char bits;
+			int c;
+
+			if (col<0 || col>=width || col%6==5)
+				continue;
+			c=(unsigned char)text[col/6];
+			if (c<' ' || c>'~')
+				c='?';
+			bits=font5x8[c-' '][col%6];
+			for (y=0;y<8;y++)
+				if (bits&(1<<y)) {
+					unsigned char *p=buffer+((12+y)*32+x)*3;
+					p[0]=r<<LEFT_SHIFT;
+					p[1]=g<<LEFT_SHIFT;
+					p[2]=b<<LEFT_SHIFT;
+				}
+		}
+	}
+	it->ms=it->n*it->frame_ms;
+	return 1;
+}
+
+int load_playlist(char *fname, struct item *items) {
+	FILE *fp;
+	char line[1024], arg[1024];
+	double fade=0, t1, t2;
+	int n=0, r, g, b, pos;
+
+	if (!(fp=fopen(fname,"r"))) {
+		perror(fname);
+		return 0;
+	}
+	while (n<MAX_ITEMS && fgets(line,sizeof(line),fp)) {
+		struct item *it=&items[n];
+		int ok=0;
+
+		line[strcspn(line,"\r\n")]='\0';
+		memset(it,0,sizeof(*it));
+		it->fade_ms=fade*1000;
+		if (line[0]=='#' || line[strspn(line," \t")]=='\0')
+			continue;
+		if (sscanf(line,"fade %lf",&fade)==1)
+			continue;
+		if (sscanf(line,"image %1023s %lf",arg,&t1)==2) {
+			it->ms=t1*1000;
+			ok=load_image(it,arg);
+		} else if (sscanf(line,"anim %1023s %lf %lf",arg,&t1,&t2)==3) {
+			it->frame_ms=t1*1000;
+			it->ms=t2*1000;
+			ok=load_anim(it,arg);
+		} else if (sscanf(line,"fill %d %d %d %lf",&r,&g,&b,&t1)==4) {
+			it->ms=t1*1000;
+			ok=load_fill(it,r,g,b);
+		} else if (sscanf(line,"text %d %d %d %lf %n",&r,&g,&b,&t1,&pos)==4) {
+			it->frame_ms=t1*1000;
+			ok=load_text(it,r,g,b,line+pos);
+		} else
+			printf("%s: cannot parse '%s'\n",fname,line);
+		if (ok && it->ms>0 && it->frame_ms>0)
+			n++;
+		else
+			free(it->frames);
+	}
+	fclose(fp);
+	return n;
+}
+
+// Crossfade in 8.8 fixed point, k=0: all a, k=256: all b
+void blend(unsigned char *a, unsigned char *b, int k, unsigned char *out) {
+	int i;
+
+	for (i=0;i<MAXBUFFER_PER_PANEL;i++)
+		out[i]=((a[i]*(256-k)+b[i]*k)>>8)&PANEL_MASK;
+}
+
+// Write on rgb_buffer at an absolute time, in ms since start
+void show(struct ledpanel *out, unsigned char *buffer, struct timespec *start, long long ms) {
+	struct timespec t=*start;
+
+	t.tv_sec+=ms/1000;
+	t.tv_nsec+=(ms%1000)*1000000;
+	if (t.tv_nsec>=1000000000) {
+		t.tv_sec++;
+		t.tv_nsec-=1000000000;
+	}
+	// a frame dimmed by LEDPANEL_POWER brightens up while we wait.
+	while (ledpanel_flush(out) && ledpanel_usec()+FADE_STEP_MS*1000LL<t.tv_sec*1000000LL+t.tv_nsec/1000)
+		ledpanel_sleep(FADE_STEP_MS*1000LL);
+	while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&t,NULL)!=0)
+		;
+	ledpanel_write(out,buffer,MAXBUFFER_PER_PANEL);
+}
+
+int main(int argc, char *argv[]) {
+	static struct item items[MAX_ITEMS];
+	unsigned char last[MAXBUFFER_PER_PANEL], prev[MAXBUFFER_PER_PANEL], out[MAXBUFFER_PER_PANEL];
+	struct timespec start;
+	long long t0=0;
+	struct ledpanel *panel;
+	char *out_spec=NULL;
+	int n, i, loops;
+
+	if (argc>2 && !strcmp(argv[1],"-o")) {
+		out_spec=argv[2];
+		argv+=2;
+		argc-=2;
+	}
+	if (argc<2 || argc>3) {
+		printf("Use: %s [-o out] playlist [loops]\n",argv[0]);
+		return 1;
+	}
+	loops=(argc==3) ? atoi(argv[2]) : 0;
+	if (!(n=load_playlist(argv[1],items))) {
+		printf("%s: nothing to play\n",argv[1]);
+		return 1;
+	}
+	if (!(panel=ledpanel_open(out_spec))) {
+		printf("open() error\n");
+		return 1;
+	}
+
+	memset(last,0,sizeof(last));
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	do {
+		for (i=0;i<n;i++) {
+			struct item *it=&items[i];
+			int t=0;
+
+			memcpy(prev,last,sizeof(prev));
+			while (t<it->ms) {
+				unsigned char *frame=it->frames+((t/it->frame_ms)%it->n)*MAXBUFFER_PER_PANEL;
+				int next=(t/it->frame_ms+1)*it->frame_ms;
+
+				if (t<it->fade_ms) {
+					blend(prev,frame,t*256/it->fade_ms,out);
+					frame=out;
+					if (t+FADE_STEP_MS<next)
+						next=t+FADE_STEP_MS;
+				}
+				if (memcmp(frame,last,MAXBUFFER_PER_PANEL)) {
+					show(panel,frame,&start,t0+t);
+					memcpy(last,frame,MAXBUFFER_PER_PANEL);
+				}
+				t=next;
+			}
+			t0+=it->ms;
+		}
+	} while (!loops || --loops);
+	ledpanel_close(panel);
+	return 0;
+}
@@ -0,0 +1,639 @@
+#!/usr/bin/python3
+# Scripted RFB server for testing vnc_tiny_view.
+#
+# Each scenario is a handshake (protocol version, security types, pixel
+# format) followed by a few framebuffer updates. The server keeps its own
+# copy of the framebuffer, converted to rgb the way the client does it,
+# which is the golden frame the client has to end up with.
+#
+#   python3 fakerfb.py --list
+#   python3 fakerfb.py --write-all DIR      DIR/NAME.vnc, DIR/NAME.rgb, DIR/sessions
+#   python3 fakerfb.py --write NAME DIR
+#   python3 fakerfb.py --serve PORT NAME    the same session for a live client,
+#   VNC_TINY_RECORD=NAME.vnc ../vnc_tiny_view 127.0.0.1 PORT
+#
+# NAME.vnc is what the client reads, which is what VNC_TINY_RECORD records.
+# "make test" replays them: vnc_tiny_view --replay NAME.vnc --expect NAME.rgb
+# A session expected to fail the handshake has no .rgb file.
+
+import os
+import socket
+import struct
+import sys
+import time
+import zlib
+
+# bpp, depth, big endian, red/green/blue max, red/green/blue shift
+FORMATS = {
+	"bgrx":     (32, 24, 0, 255, 255, 255, 16,  8,  0),
+	"rgbx":     (32, 24, 0, 255, 255, 255,  0,  8, 16),
+	"xrgb":     (32, 24, 1, 255, 255, 255, 16,  8,  0),
+	"xbgr":     (32, 24, 1, 255, 255, 255,  0,  8, 16),
+	"rgb565le": (16, 16, 0,  31,  63,  31, 11,  5,  0),
+	"rgb565be": (16, 16, 1,  31,  63,  31, 11,  5,  0),
+	"rgb332":   ( 8,  8, 0,   7,   7,   3,  5,  2,  0),
+	"bgr233":   ( 8,  8, 0,   7,   7,   3,  0,  3,  6),
+	# no specialized kernel, vnc_blt_generic()
+	"rgb555le": (16, 15, 0,  31,  31,  31, 10,  5,  0),
+	"rgb444be": (16, 12, 1,  15,  15,  15,  8,  4,  0),
+	"rgbhi":    (32, 24, 0, 255, 255, 255, 24, 16,  8),
+}
+
+RAW, COPYRECT, TIGHT, LASTRECT = 0, 1, 7, -224
+
+
+def noise(seed):
+	# 8 bit r,g,b: a smooth ramp with some noise on top
+	def f(x, y):
+		h = ((x + 1) * 73856093 ^ (y + 1) * 19349663 ^ (seed + 1) * 83492791) & 0xffffff
+		return ((x * 8 + (h & 31)) & 255, (y * 8 + (h >> 8 & 31)) & 255, (seed * 40 + (h >> 16 & 63)) & 255)
+	return f
+
+
+def solid(r, g, b):
+	return lambda x, y: (r, g, b)
+
+
+def blocks(seed, bw, bh):
+	# one color per bw x bh block, for scaled views the average is exact
+	f = noise(seed)
+	return lambda x, y: f(x // bw, y // bh)
+
+
+def compact(n):
+	b = bytearray([n & 0x7f])
+	if n > 0x7f:
+		b[0] |= 0x80
+		b.append(n >> 7 & 0x7f)
+		if n > 0x3fff:
+			b[1] |= 0x80
+			b.append(n >> 14)
+	return bytes(b)
+
+
+class Session:
+	def __init__(self, fmt="bgrx", width=32, height=32):
+		self.script = []	# bytes, or ("read", n) / ("request",) where a live server waits
+		self.fmt = FORMATS[fmt]
+		self.width = width
+		self.height = height
+		self.fb = [[(0, 0, 0)] * width for y in range(height)]
+		self.view = (0, 0, 32, 32)	# what the replay shows, VNC_TINY_VIEW
+		self.panel = (32, 32)
+		self.env = ""		# for the replay, e.g. VNC_TINY_VIEW
+		self.fails = False	# the handshake is refused, no golden frame
+		self.shown = None	# the framebuffer when the client has to close
+		self.zs = [zlib.compressobj(6) for i in range(4)]
+		self.rects = None
+
+	def scale(self, view, panel):
+		self.view = view
+		self.panel = panel
+		self.env = "VNC_TINY_PANEL=%dx%d VNC_TINY_VIEW=%dx%d+%d+%d" % (panel + view[2:] + view[:2])
+
+	def send(self, data):
+		self.script.append(bytes(data))
+
+	def wait(self, *what):
+		self.script.append(what)
+
+	# handshake
+	def version(self, v, security):
+		self.send(v)
+		self.wait("read", 12)
+		minor = int(v[8:11])
+		if minor < 7:
+			self.send(struct.pack(">I", security[0]))
+		else:
+			self.send(bytes([len(security)] + security))
+			if security:
+				self.wait("read", 1)
+		self.minor = minor
+
+	def result(self, reason=None):
+		if reason is None:
+			self.send(struct.pack(">I", 0))
+		else:
+			self.send(struct.pack(">II", 1, len(reason)) + reason)
+			self.fails = True
+
+	def reason(self, reason):
+		# after security type 0 (3.3) or an empty list (3.7+)
+		self.send(struct.pack(">I", len(reason)) + reason)
+		self.fails = True
+
+	def server_init(self, name=b"fakerfb"):
+		self.wait("read", 1)
+		bpp, depth, be, rmax, gmax, bmax, rs, gs, bs = self.fmt
+		self.send(struct.pack(">HH", self.width, self.height) +
+			struct.pack(">BBBBHHHBBB3x", bpp, depth, be, 1, rmax, gmax, bmax, rs, gs, bs) +
+			struct.pack(">I", len(name)) + name)
+		self.wait("request")
+
+	def start(self, v=b"RFB 003.008\n", security=[1]):
+		self.version(v, security)
+		if self.minor >= 8:
+			self.result()
+		self.server_init()
+
+	# pixels
+	def component(self, c, cmax):
+		# an 8 bit value as the server would have it
+		return c * (cmax + 1) >> 8
+
+	def pixel(self, rgb):
+		# server pixel bytes and the rgb the client makes of them
+		bpp, depth, be, rmax, gmax, bmax, rs, gs, bs = self.fmt
+		r, g, b = self.component(rgb[0], rmax), self.component(rgb[1], gmax), self.component(rgb[2], bmax)
+		v = r << rs | g << gs | b << bs
+		data = v.to_bytes(bpp // 8, "big" if be else "little")
+		return data, (r * 255 // rmax, g * 255 // gmax, b * 255 // bmax)
+
+	def tpixel(self, rgb):
+		bpp, depth, be, rmax, gmax, bmax = self.fmt[:6]
+		if bpp == 32 and depth == 24 and rmax == gmax == bmax == 255:
+			return bytes(rgb), tuple(rgb)
+		return self.pixel(rgb)
+
+	def put(self, x, y, c):
+		if x < self.width and y < self.height:
+			self.fb[y][x] = c
+
+	def closes(self):
+		# the next rectangle is invalid, nothing from here on is shown
+		self.shown = [row[:] for row in self.fb]
+
+	# updates, rectangles are collected between begin() and end()
+	def begin(self):
+		self.rects = []
+
+	def end(self, lastrect=False):
+		if lastrect:
+			self.rects.append(struct.pack(">HHHHi", 0, 0, 0, 0, LASTRECT))
+			n = 0xffff
+		else:
+			n = len(self.rects)
+		self.send(b"\0\0" + struct.pack(">H", n) + b"".join(self.rects))
+		self.rects = None
+
+	def rect(self, x, y, w, h, enc, data):
+		self.rects.append(struct.pack(">HHHHi", x, y, w, h, enc) + data)
+
+	def raw(self, x, y, w, h, f):
+		data = bytearray()
+		for j in range(y, y + h):
+			for i in range(x, x + w):
+				p, c = self.pixel(f(i, j))
+				self.put(i, j, c)
+				data += p
+		self.rect(x, y, w, h, RAW, data)
+
+	def raw_garbage(self, x, y, w, h):
+		# past the edge, the client must close instead of drawing it
+		bpp = self.fmt[0] // 8
+		self.rect(x, y, w, h, RAW, bytes((i * 37) & 255 for i in range(w * h * bpp)))
+
+	def copyrect(self, x, y, w, h, sx, sy):
+		if sx + w <= self.width and sy + h <= self.height:
+			src = [row[sx:sx + w] for row in self.fb[sy:sy + h]]
+			for j in range(h):
+				self.fb[y + j][x:x + w] = src[j]
+		self.rect(x, y, w, h, COPYRECT, struct.pack(">HH", sx, sy))
+
+	def zdata(self, stream, data):
+		if len(data) < 12:
+			return bytes(data)
+		z = self.zs[stream].compress(bytes(data)) + self.zs[stream].flush(zlib.Z_SYNC_FLUSH)
+		return compact(len(z)) + z
+
+	def control(self, stream, reset, explicit):
+		for i in range(4):
+			if reset & 1 << i:
+				self.zs[i] = zlib.compressobj(6)
+		return (stream | (4 if explicit else 0)) << 4 | reset
+
+	def tight_fill(self, x, y, w, h, rgb):
+		data, c = self.tpixel(rgb)
+		for j in range(y, y + h):
+			for i in range(x, x + w):
+				self.put(i, j, c)
+		self.rect(x, y, w, h, TIGHT, bytes([0x80]) + data)
+
+	def tight_copy(self, x, y, w, h, f, stream=0, reset=0, explicit=False):
+		ctl = self.control(stream, reset, explicit)
+		data = bytearray()
+		for j in range(y, y + h):
+			for i in range(x, x + w):
+				p, c = self.tpixel(f(i, j))
+				self.put(i, j, c)
+				data += p
+		self.rect(x, y, w, h, TIGHT, bytes([ctl] + ([0] if explicit else [])) + self.zdata(stream, data))
+
+	def tight_palette(self, x, y, w, h, colors, stream=1, reset=0):
+		ctl = self.control(stream, reset, True)
+		pal = [self.tpixel(c) for c in colors]
+		n = len(colors)
+		data = bytearray()
+		for j in range(h):
+			bits = 0
+			for i in range(w):
+				k = (i * 3 + j * 5 + (i * j >> 2)) % n
+				self.put(x + i, y + j, pal[k][1])
+				if n > 2:
+					data.append(k)
+				else:
+					bits = bits << 1 | k
+					if i % 8 == 7 or i == w - 1:
+						data.append(bits << (7 - i % 8) & 255)
+						bits = 0
+		self.rect(x, y, w, h, TIGHT, bytes([ctl, 1, n - 1]) + b"".join(p[0] for p in pal) + self.zdata(stream, data))
+
+	def tight_gradient(self, x, y, w, h, f, stream=2, reset=0):
+		# 24 bit true color only
+		ctl = self.control(stream, reset, True)
+		px = [[tuple(f(x + i, y + j)) for i in range(w)] for j in range(h)]
+		data = bytearray()
+		for j in range(h):
+			for i in range(w):
+				for c in range(3):
+					left = px[j][i - 1][c] if i else 0
+					up = px[j - 1][i][c] if j else 0
+					corner = px[j - 1][i - 1][c] if i and j else 0
+					pred = max(0, min(255, left + up - corner))
+					data.append(px[j][i][c] - pred & 255)
+				self.put(x + i, y + j, px[j][i])
+		self.rect(x, y, w, h, TIGHT, bytes([ctl, 2]) + self.zdata(stream, data))
+
+	# output
+	def recording(self):
+		return b"".join(s for s in self.script if isinstance(s, bytes))
+
+	def golden(self):
+		fb = self.shown or self.fb
+		x, y, w, h = self.view
+		pw, ph = self.panel
+		out = bytearray()
+		for j in range(ph):
+			y0, y1 = y + j * h // ph, y + max((j + 1) * h // ph, j * h // ph + 1)
+			for i in range(pw):
+				x0, x1 = x + i * w // pw, x + max((i + 1) * w // pw, i * w // pw + 1)
+				area = (x1 - x0) * (y1 - y0)
+				for c in range(3):
+					v = sum(fb[sy][sx][c] for sy in range(y0, y1) for sx in range(x0, x1))
+					out.append((v + area // 2) // area)
+		return bytes(out)
+
+
+SCENARIOS = []
+
+
+def scenario(f):
+	SCENARIOS.append(f)
+	return f
+
+
+def frames(s, n=2, enc="raw"):
+	# a full frame, then partial updates on top
+	for k in range(n):
+		s.begin()
+		if k == 0:
+			s.raw(0, 0, s.width, s.height, noise(k))
+		else:
+			s.raw(3 * k, 2 * k, 17, 11, noise(k))
+			s.raw(20, 24 - k, 12, 8, noise(k + 7))
+		s.end()
+
+
+# protocol versions and security types, the client only does None
+@scenario
+def v33(s):
+	s.start(b"RFB 003.003\n", [1])
+	frames(s, 3)
+
+@scenario
+def v35(s):
+	s.start(b"RFB 003.005\n", [1])		# treated as 3.3
+	frames(s)
+
+@scenario
+def v37(s):
+	s.start(b"RFB 003.007\n", [1])
+	frames(s, 3)
+
+@scenario
+def v38(s):
+	s.start(b"RFB 003.008\n", [1])
+	frames(s, 3)
+
+@scenario
+def v3889(s):
+	s.start(b"RFB 003.889\n", [1])		# Apple Remote Desktop, spoken to as 3.8
+	frames(s)
+
+@scenario
+def auth_none_last(s):
+	s.start(b"RFB 003.008\n", [2, 16, 1])
+	frames(s)
+
+def refused(s):
+	# a client that goes on anyway shows a frame
+	s.server_init()
+	frames(s, 1)
+
+@scenario
+def auth_refused_33(s):
+	s.version(b"RFB 003.003\n", [0])
+	s.reason(b"Too many security failures")
+	refused(s)
+
+@scenario
+def auth_vnc_33(s):
+	s.version(b"RFB 003.003\n", [2])
+	s.fails = True
+	refused(s)
+
+@scenario
+def auth_refused_37(s):
+	s.version(b"RFB 003.007\n", [])
+	s.reason(b"Server is busy")
+	refused(s)
+
+@scenario
+def auth_refused_38(s):
+	s.version(b"RFB 003.008\n", [1])
+	s.result(b"Access denied")
+	refused(s)
+
+
+# every pixel format, through the kernels and vnc_blt_generic()
+def raw_format(fmt):
+	def f(s):
+		s.start()
+		frames(s, 3)
+	f.__name__ = "raw_" + fmt
+	f.format = fmt
+	return f
+
+for fmt in FORMATS:
+	scenario(raw_format(fmt))
+
+
+@scenario
+def raw_lastrect(s):
+	s.start()
+	s.begin()
+	s.raw(0, 0, 32, 32, noise(1))
+	s.raw(5, 5, 9, 9, noise(2))
+	s.end(lastrect=True)
+
+@scenario
+def raw_bounds(s):
+	s.start()
+	frames(s)
+	s.closes()
+	s.begin()
+	s.raw_garbage(28, 4, 8, 4)
+	s.end()
+	s.begin()
+	s.raw(0, 0, 32, 32, solid(255, 0, 0))	# never shown
+	s.end()
+
+
+@scenario
+def copyrect(s):
+	s.start()
+	frames(s, 1)
+	s.begin()
+	s.copyrect(4, 6, 20, 16, 0, 0)		# down right, overlapping
+	s.copyrect(0, 0, 16, 12, 8, 10)		# up left, overlapping
+	s.copyrect(3, 28, 24, 4, 0, 28)		# along a row
+	s.copyrect(24, 0, 8, 8, 0, 24)		# apart
+	s.end()
+
+@scenario
+def copyrect_bounds(s):
+	s.start()
+	frames(s, 1)
+	s.closes()
+	s.begin()
+	s.copyrect(0, 0, 8, 8, 28, 0)		# source past the edge
+	s.end()
+	s.begin()
+	s.raw(0, 0, 32, 32, solid(255, 0, 0))	# never shown
+	s.end()
+
+
+@scenario
+def raw_scaled(s):
+	# bands of large rectangles end within a box of small ones (-DHAVE_PTHREAD)
+	s.scale((0, 0, 128, 96), (32, 24))
+	s.start()
+	for k in range(3):
+		f = blocks(k, 4, 4)
+		s.begin()
+		s.raw(0, 0, 128, 34 + k, f)
+		for i in range(0, 128, 16):
+			s.raw(i, 34 + k, 16, 6 - k, f)
+		s.raw(0, 40, 128, 56, f)
+		for i in range(8, 120, 24):
+			s.raw(i, 38 - k, 8, 2, f)
+		s.end()
+raw_scaled.format = "rgb565le"
+raw_scaled.size = (128, 96)
+
+
+@scenario
+def scaled_13x13(s):
+	# box areas without an exact 16 bit reciprocal, white has to stay 255
+	s.scale((0, 0, 104, 78), (8, 6))
+	s.start()
+	s.begin()
+	s.raw(0, 0, 104, 78, blocks(5, 13, 13))
+	s.raw(13, 13, 26, 26, solid(255, 255, 255))
+	s.raw(52, 26, 13, 13, solid(1, 128, 254))
+	s.end()
+scaled_13x13.size = (104, 78)
+
+@scenario
+def scaled_huge(s):
+	# one box of 300x230 pixels, more than 16 bits of area
+	s.scale((0, 0, 300, 230), (1, 1))
+	s.start()
+	s.begin()
+	s.raw(0, 0, 300, 1, solid(255, 255, 255))
+	n = 1
+	while n < 230:
+		s.copyrect(0, n, 300, min(n, 230 - n), 0, 0)
+		n *= 2
+	s.end()
+scaled_huge.size = (300, 230)
+
+
+# tight, all filters, on each pixel size
+def tight_frames(s, gradient=True):
+	s.begin()
+	s.tight_copy(0, 0, 32, 32, noise(1), stream=0)
+	s.tight_fill(2, 2, 10, 6, (10, 200, 30))
+	s.tight_copy(20, 3, 2, 1, noise(2), stream=0)			# < 12 bytes, not compressed
+	s.end()
+	s.begin()
+	s.tight_palette(0, 8, 13, 9, [(255, 0, 0), (0, 0, 255)], stream=1)	# one bit per pixel
+	s.tight_palette(14, 8, 18, 9, [(0, 0, 0), (255, 255, 0), (0, 255, 255), (128, 64, 32), (250, 250, 250)], stream=1)
+	s.tight_copy(0, 18, 16, 6, noise(3), stream=3, explicit=True)
+	if gradient:
+		s.tight_gradient(16, 18, 16, 14, noise(4), stream=2)
+	s.end()
+	s.begin()
+	s.tight_copy(4, 24, 24, 8, noise(5), stream=0, reset=1)		# new zlib stream 0
+	s.tight_palette(0, 0, 9, 5, [(1, 2, 3), (250, 128, 7)], stream=1, reset=2)
+	s.end()
+
+@scenario
+def tight_bgrx(s):
+	s.start()
+	tight_frames(s)
+tight_bgrx.format = "bgrx"
+
+@scenario
+def tight_rgbhi(s):
+	s.start()
+	tight_frames(s)
+tight_rgbhi.format = "rgbhi"
+
+@scenario
+def tight_rgb565le(s):
+	s.start()
+	tight_frames(s, gradient=False)
+tight_rgb565le.format = "rgb565le"
+
+@scenario
+def tight_bgr233(s):
+	s.start()
+	tight_frames(s, gradient=False)
+tight_bgr233.format = "bgr233"
+
+@scenario
+def tight_palette1(s):
+	# a 1 color palette is packed at 1 bit per pixel as well
+	s.start()
+	tight_frames(s, gradient=False)
+	s.begin()
+	s.tight_palette(0, 0, 13, 9, [(200, 30, 90)], stream=1)		# 18 bytes, compressed
+	s.tight_palette(20, 20, 5, 4, [(30, 90, 200)], stream=1)	# 4 bytes, not compressed
+	s.tight_copy(16, 0, 16, 16, noise(6), stream=0)
+	s.end()
+
+@scenario
+def tight_bounds(s):
+	s.start()
+	frames(s, 1)
+	s.closes()
+	s.begin()
+	s.tight_fill(30, 30, 4, 4, (255, 255, 255))
+	s.end()
+	s.begin()
+	s.raw(0, 0, 32, 32, solid(255, 0, 0))	# never shown
+	s.end()
+
+
+def name(f):
+	return f.__name__.replace("_", "-")
+
+
+def build(f):
+	s = Session(getattr(f, "format", "bgrx"), *getattr(f, "size", (32, 32)))
+	f(s)
+	return s
+
+
+def write(f, dir):
+	s = build(f)
+	open(os.path.join(dir, name(f) + ".vnc"), "wb").write(s.recording())
+	golden = os.path.join(dir, name(f) + ".rgb")
+	if s.fails:
+		if os.path.exists(golden):
+			os.unlink(golden)
+	else:
+		open(golden, "wb").write(s.golden())
+	return s
+
+
+def recvn(c, n):
+	b = b""
+	while len(b) < n:
+		d = c.recv(n - len(b))
+		if not d:
+			raise EOFError
+		b += d
+	return b
+
+
+def client_message(c):
+	# returns the message type, after skipping its body
+	t = recvn(c, 1)[0]
+	if t == 0:
+		recvn(c, 19)
+	elif t == 2:
+		n = struct.unpack(">xH", recvn(c, 3))[0]
+		recvn(c, 4 * n)
+	elif t == 3 or t == 150:
+		recvn(c, 9)
+	elif t == 4:
+		recvn(c, 7)
+	elif t == 5:
+		recvn(c, 5)
+	elif t == 6:
+		recvn(c, struct.unpack(">3xI", recvn(c, 7))[0])
+	elif t == 248:
+		recvn(c, struct.unpack(">3xIB", recvn(c, 8))[1])
+	else:
+		raise ValueError("client message %d" % t)
+	return t
+
+
+def serve(port, f):
+	s = build(f)
+	ls = socket.socket()
+	ls.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	ls.bind(("127.0.0.1", port))
+	ls.listen(1)
+	c, addr = ls.accept()
+	try:
+		for step in s.script:
+			if isinstance(step, bytes):
+				c.sendall(step)
+			elif step[0] == "read":
+				recvn(c, step[1])
+			else:
+				while client_message(c) != 3:
+					pass
+		time.sleep(0.5)
+	except (EOFError, socket.error):
+		pass
+	c.close()
+
+
+def main(av):
+	by_name = dict((name(f), f) for f in SCENARIOS)
+	if len(av) == 2 and av[1] == "--list":
+		for f in SCENARIOS:
+			print(name(f))
+	elif len(av) == 3 and av[1] == "--write-all":
+		with open(os.path.join(av[2], "sessions"), "w") as m:
+			m.write("# written by fakerfb.py --write-all: name, exit status of --replay, environment\n")
+			for f in SCENARIOS:
+				s = write(f, av[2])
+				m.write(("%-16s %d %s" % (name(f), 2 if s.fails else 0, s.env)).rstrip() + "\n")
+	elif len(av) == 4 and av[1] == "--write" and av[2] in by_name:
+		write(by_name[av[2]], av[3])
+	elif len(av) == 4 and av[1] == "--serve" and av[3] in by_name:
+		serve(int(av[2]), by_name[av[3]])
+	else:
+		print("Syntax:")
+		print("  %s --list | --write-all DIR | --write NAME DIR | --serve PORT NAME" % (av[0]))
+		return 1
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main(sys.argv))
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Replays the sessions listed in test/sessions, see fakerfb.py.
+# Usage: test/run.sh ./vnc_tiny_view
+# A session passes when --replay exits as listed and, for exit status 0,
+# the last frame matches NAME.rgb byte for byte.
+
+bin=${1:-./vnc_tiny_view}
+dir=`dirname "$0"`
+fail=0
+pass=0
+
+while read name status env; do
+	case "$name" in ""|\#*) continue;; esac
+	expect=
+	[ -f "$dir/$name.rgb" ] && expect="--expect $dir/$name.rgb"
+	log=`env LEDPANEL=null $env "$bin" --replay "$dir/$name.vnc" $expect 2>&1 >/dev/null`
+	rc=$?
+	if [ $rc != "$status" ] && echo "$log" | grep -q "ENCODING_ type: 7$"; then
+		printf '%-16s skipped, tight needs -DHAVE_ZLIB\n' "$name"
+	elif [ $rc = "$status" ]; then
+		printf '%-16s ok   %s\n' "$name" "`echo "$log" | sed -n 's/^replay: \(.*Mbyte\/s\).*/\1/p'`"
+		pass=$((pass + 1))
+	else
+		printf '%-16s FAIL exit %d, expected %d\n%s\n' "$name" $rc "$status" "$log"
+		fail=$((fail + 1))
+	fi
+done < "$dir/sessions"
+
+echo "$pass passed, $fail failed"
+[ $fail = 0 ]
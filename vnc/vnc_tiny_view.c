@@ -13,8 +13,34 @@
  * x11vnc -clip 640x480+0+0 -cursor none -repeat -loop
  * env VNC_TINY_CFG=/tmp/fifo vnc_tiny_view HOSTNAME
  * echo 10 20 > /tmp/fifo
+ * echo 10 20 320 240 > /tmp/fifo	# view 320x240 scaled down to the panel
+ * env VNC_TINY_CTL=/tmp/vnc.ctl vnc_tiny_view HOSTNAME
+ * echo "set view 320x240+0+0; set refresh 100; get stats" | socat - UNIX-CONNECT:/tmp/vnc.ctl
+ * env VNC_TINY_PAN="600,0@3000 600,400@2000 0,0@3000 loop" vnc_tiny_view HOSTNAME
+ * pans at VNC_TINY_FPS (30) from a cached VNC_TINY_MARGIN around the view.
  *
  * VNC_TINY_STDOUT=1 can be set for a crude console view.
+ * VNC_TINY_STATS=100 prints bytes per update every 100 updates, e.g. to
+ * compare VNC_TINY_ENCODINGS=tight,raw (needs HAVE_ZLIB) and =raw.
+ * VNC_TINY_STDOUT=256, truecolor or ramp select other palettes,
+ * e.g. VNC_TINY_STDOUT=truecolor,half uses half blocks for square pixels.
+ * Servers offering ContinuousUpdates push changes without being polled,
+ * VNC_TINY_CONTINUOUS=0 polls every msec_refresh instead.
+ * VNC_TINY_LATENCY=200 (ms) is the budget before frames are skipped and
+ * continuous updates paused, when the panel cannot keep up.
+ * LEDPANEL=emu, file:PATH, shm:PATH replaces the rgb_buffer, see ../ledpanel.h.
+ * LEDPANEL_POWER=40 dims frames that would draw more than 40% of all white.
+ * VNC_TINY_RECORD=session.vnc saves what the server sends, for --replay.
+ * make test replays the sessions of test/fakerfb.py against golden frames.
+ * VNC_TINY_PROBE=100 reports latency percentiles of ../latency_probe.py.
+ * VNC_TINY_STATE=/var/lib/vnc_tiny_view.state shows the last frame of the
+ * previous run at once and connects to its address without a DNS lookup.
+ * With -m, each tile keeps its own VNC_TINY_STATE.N, N counting from 0.
+ * Built with -DHAVE_PTHREAD, large rectangles decode on VNC_TINY_THREADS
+ * (all) cores.
+ *
+ * Raw video without vnc:
+ * ffmpeg -i movie.mp4 -f rawvideo -pix_fmt rgb24 -s 64x64 - | vnc_tiny_view -i 64x64
  *
  *
  * Code taken from GTK VNC Widget.
@@ -42,28 +68,30 @@
  */
 
 
-/*
- *
- * FIXME:
- * - add gamma lookup tables to draw_ledpanel_data
- * - view.moved: triggers a full refresh: It should move the ledpanel contents 
- *   locally and only send refresh requests for missing parts.
- */
-
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/ioctl.h>	// ioctl FIONREAD
 #include <sys/stat.h>	// mkfifo()
+#include <sys/un.h>	// control socket
 #include <fcntl.h>	// open()
 #include <netdb.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>	// clock_gettime()
+#include <glob.h>
+#include <ctype.h>
+#include <signal.h>	// VNC_TINY_STATE, save on SIGTERM
+#include <errno.h>
+#include "ledpanel.h"	// output sinks, LEDPANEL=emu etc.
 #ifdef HAVE_ZLIB
 # include <zlib.h>	// BuildRequires: zlib-devel
 #endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>	// parallel decode
+#endif
 
 void cursor_up(int n)
 {
@@ -72,7 +100,7 @@ void cursor_up(int n)
   fflush(stdout);
 }
 
-void rgb_ttyramp(int r, int g, int b)
+char rgb_ramp_char(int r, int g, int b)
 {
   // http://paulbourke.net/dataformats/asciiart/
   unsigned int v = (r+g+b)/3;
@@ -80,19 +108,26 @@ void rgb_ttyramp(int r, int g, int b)
   static char ascii_ramp[] = "$@B%8&WM#*oahkbdpqwmZO0QLCJUYXzcvunxrjft/|()1{}[]?-_+~<>i!lI;:,\"^'. ";
   unsigned int i = v * (sizeof(ascii_ramp)-2) / 255;
   i = sizeof(ascii_ramp)-2-i;
-  fputc(ascii_ramp[i], stdout);
-  fputc(ascii_ramp[i], stdout);
+  return ascii_ramp[i];
 }
 
-void rgb_tty8c(int r, int g, int b)
+void rgb_ttyramp(int r, int g, int b)
+{
+  char c = rgb_ramp_char(r, g, b);
+  fputc(c, stdout);
+  fputc(c, stdout);
+}
+
+// returns the ansi foreground color 30..37, *dim is set for darker colors.
+int rgb_ansi8(int r, int g, int b, int *dim)
 {
-  int dim = 1;
   int ansi = 0;
 
+  *dim = 1;
   if (r < 100) r = 0;
   if (g < 100) g = 0;
   if (b < 100) b = 0;
-  if ((r >= 200) || (g >= 200) || (b >= 200)) dim = 0;
+  if ((r >= 200) || (g >= 200) || (b >= 200)) *dim = 0;
   if (r && g && b) ansi = 37;	// white
   else if (r && g) ansi = 33;	// yellow
   else if (r && b) ansi = 35;	// magenta
@@ -101,6 +136,13 @@ void rgb_tty8c(int r, int g, int b)
   else if (g)      ansi = 32;	// green
   else if (b)      ansi = 34;	// blue
   else             ansi = 30;	// black
+  return ansi;
+}
+
+void rgb_tty8c(int r, int g, int b)
+{
+  int dim;
+  int ansi = rgb_ansi8(r, g, b, &dim);
 
   fprintf(stdout, "\x1b[%d;1;%dm%s\x1b[0m", ansi, ansi+10, dim?"  ":"@@");
 }
@@ -144,19 +186,194 @@ void draw_ttyramp(int ww, int hh, unsigned char *img, int stride)
 }
 
 
-void read_rgb_file(int w, int h, char *fname, unsigned char *buf)
+int read_rgb_file(int w, int h, char *fname, unsigned char *buf)
 {
   int i;
   FILE *fp = fopen(fname, "r");
+  if (!fp) return 0;
   for (i = 0; i < w*h*3; i++)
     *buf++ = fgetc(fp);
   fclose(fp);
+  return 1;
+}
+
+long long now_usec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// FROM /usr/include/glib-2.0/glib/gmacros.h
+#define FALSE (0)
+#define TRUE  (!FALSE)
+// FROM /usr/include/glib-2.0/glib/gtypes.h
+#define G_BIG_ENDIAN	4321
+#define G_LITTLE_ENDIAN	1234
+
+typedef struct VncRect
+{
+  int x, y, w, h;
+} VncRect;
+
+static void vnc_rect_union(VncRect *r, int x, int y, int w, int h)
+{
+  int x1, y1;
+
+  if (w <= 0 || h <= 0) return;
+  if (r->w <= 0 || r->h <= 0)
+    {
+      r->x = x; r->y = y; r->w = w; r->h = h;
+      return;
+    }
+  x1 = (r->x + r->w > x + w) ? r->x + r->w : x + w;
+  y1 = (r->y + r->h > y + h) ? r->y + r->h : y + h;
+  if (x < r->x) r->x = x;
+  if (y < r->y) r->y = y;
+  r->w = x1 - r->x;
+  r->h = y1 - r->y;
+}
+
+// returns FALSE if a and b do not overlap.
+static int vnc_rect_intersect(VncRect *a, VncRect *b, VncRect *out)
+{
+  int x0 = a->x > b->x ? a->x : b->x;
+  int y0 = a->y > b->y ? a->y : b->y;
+  int x1 = (a->x + a->w < b->x + b->w) ? a->x + a->w : b->x + b->w;
+  int y1 = (a->y + a->h < b->y + b->h) ? a->y + a->h : b->y + b->h;
+
+  if (x1 <= x0 || y1 <= y0)
+    return FALSE;
+  out->x = x0; out->y = y0; out->w = x1 - x0; out->h = y1 - y0;
+  return TRUE;
+}
+
+static int vnc_rect_contains(VncRect *a, VncRect *b)
+{
+  return b->x >= a->x && b->y >= a->y && b->x + b->w <= a->x + a->w && b->y + b->h <= a->y + a->h;
+}
+
+/*
+ * Box filter downscaler.
+ * All divisions happen once in vnc_scaler_init(): each destination pixel
+ * averages the source box [x0,x1) x [y0,y1) and multiplies the sum with a
+ * rounded 8.24 reciprocal of the box area, exact for areas up to 65536.
+ * Larger boxes (recip 0) are divided.
+ * When upscaling, boxes degenerate to a single source pixel (nearest neighbour).
+ */
+#define VNC_SCALER_BITS	24
+
+typedef struct VncScaler
+{
+  int sw, sh;			// source size
+  int dw, dh;			// destination size
+  int *x0, *x1;			// source columns per destination column
+  int *y0, *y1;			// source rows per destination row
+  u_int32_t *recip;		// 2^24/area per destination pixel, 0: divide
+} VncScaler;
+
+void vnc_scaler_free(VncScaler *s)
+{
+  free(s->x0); free(s->x1);
+  free(s->y0); free(s->y1);
+  free(s->recip);
+  memset(s, 0, sizeof(*s));
+}
+
+static void vnc_scaler_axis(int sn, int dn, int *a0, int *a1)
+{
+  int i;
+  for (i = 0; i < dn; i++)
+    {
+      a0[i] = i * sn / dn;
+      a1[i] = (i+1) * sn / dn;
+      if (a1[i] <= a0[i]) a1[i] = a0[i] + 1;
+    }
+}
+
+int vnc_scaler_init(VncScaler *s, int sw, int sh, int dw, int dh)
+{
+  int x, y;
+
+  if (s->x0 && s->sw == sw && s->sh == sh && s->dw == dw && s->dh == dh)
+    return TRUE;
+  vnc_scaler_free(s);
+  if (sw < 1 || sh < 1 || dw < 1 || dh < 1)
+    return FALSE;
+
+  s->sw = sw; s->sh = sh;
+  s->dw = dw; s->dh = dh;
+  s->x0 = (int *)calloc(dw, sizeof(int));
+  s->x1 = (int *)calloc(dw, sizeof(int));
+  s->y0 = (int *)calloc(dh, sizeof(int));
+  s->y1 = (int *)calloc(dh, sizeof(int));
+  s->recip = (u_int32_t *)calloc(dw * dh, sizeof(u_int32_t));
+  vnc_scaler_axis(sw, dw, s->x0, s->x1);
+  vnc_scaler_axis(sh, dh, s->y0, s->y1);
+  for (y = 0; y < dh; y++)
+    for (x = 0; x < dw; x++)
+      {
+        u_int32_t area = (s->x1[x] - s->x0[x]) * (s->y1[y] - s->y0[y]);
+        s->recip[y*dw+x] = area > 65536 ? 0 : ((1 << VNC_SCALER_BITS) + area/2) / area;
+      }
+  return TRUE;
+}
+
+/*
+ * Filter the destination pixels touched by the source rectangle x,y,w,h.
+ * src points to source pixel (0,0), dst to destination pixel (0,0);
+ * both carry nch interleaved 8 bit channels.
+ * If out is given, the destination rectangle written is added to it.
+ */
+void vnc_scaler_rect(VncScaler *s, unsigned char *src, int sstride,
+                     unsigned char *dst, int dstride, int nch,
+                     int x, int y, int w, int h, VncRect *out)
+{
+  int dx0, dx1, dy0, dy1, dx, dy, c;
+
+  for (dx0 = 0; dx0 < s->dw && s->x1[dx0] <= x; dx0++) ;
+  for (dx1 = dx0; dx1 < s->dw && s->x0[dx1] < x + w; dx1++) ;
+  for (dy0 = 0; dy0 < s->dh && s->y1[dy0] <= y; dy0++) ;
+  for (dy1 = dy0; dy1 < s->dh && s->y0[dy1] < y + h; dy1++) ;
+  if (out) vnc_rect_union(out, dx0, dy0, dx1 - dx0, dy1 - dy0);
+
+  for (dy = dy0; dy < dy1; dy++)
+    {
+      unsigned char *d = dst + dy * dstride + dx0 * nch;
+      for (dx = dx0; dx < dx1; dx++)
+        {
+          u_int32_t sum[4] = { 0, 0, 0, 0 };
+          u_int32_t r = s->recip[dy * s->dw + dx];
+          u_int32_t area = r ? 1 : (s->x1[dx] - s->x0[dx]) * (s->y1[dy] - s->y0[dy]);
+          int sx, sy;
+
+          for (sy = s->y0[dy]; sy < s->y1[dy]; sy++)
+            {
+              unsigned char *p = src + sy * sstride + s->x0[dx] * nch;
+              for (sx = s->x0[dx]; sx < s->x1[dx]; sx++)
+                for (c = 0; c < nch; c++)
+                  sum[c] += *p++;
+            }
+          for (c = 0; c < nch; c++)
+            {
+              u_int32_t v = r ? (u_int32_t)(((u_int64_t)sum[c] * r + (1 << (VNC_SCALER_BITS-1))) >> VNC_SCALER_BITS)
+                              : (sum[c] + area/2) / area;
+              *d++ = v > 255 ? 255 : v;
+            }
+        }
+    }
+}
+
+void vnc_scaler_run(VncScaler *s, unsigned char *src, int sstride,
+                    unsigned char *dst, int dstride, int nch)
+{
+  vnc_scaler_rect(s, src, sstride, dst, dstride, nch, 0, 0, s->sw, s->sh, NULL);
 }
 
 typedef struct VncView
 {
   int x, y, w, h;
-  int moved;	// FIXME: every move here currently triggers a full update.
+  int moved;	// needs a full update, e.g. after a desktop resize
 } VncView;
 
 typedef struct VncPixelFormat
@@ -173,6 +390,9 @@ typedef struct VncPixelFormat
   int blue_shift;
 } VncPixelFormat;
 
+// converts n pixels of the server format to rgb, see vnc_blt_select().
+typedef void (*VncBltFunc)(const VncPixelFormat *fmt, const u_int8_t *src, unsigned char *rgb, int n);
+
 typedef struct VncConnectionPrivate
 {
   int absPointer;
@@ -184,14 +404,45 @@ typedef struct VncConnectionPrivate
   int height;
   int has_error;
   VncPixelFormat fmt;
+  VncBltFunc blt;	// chosen once per pixel format
   char *name;
   unsigned char *rgb;
+  int fb_width, fb_height;	// size of rgb, survives reconnects
+  int fb_reused;
+  VncRect dirty;	// changed since last expose, relative to the exposed view
+  int cu_supported;	// server sent EndOfContinuousUpdates
+  int cu_active;	// server pushes updates for the view, no polling
+  int last_rect;	// LastRect seen, the update ends early
+  int fence_supported;	// server sent a Fence request
+  long long fence_sent;	// usec, our Fence in flight or 0
+  long long fence_next;	// usec, one Fence per second is plenty
+  long long latency;	// usec, last Fence round trip
+  long long last_expose;	// usec
+  long long throttled_until;	// usec, polling instead of continuous updates
+  struct {
+        long long usec;	// decode and output time ...
+        long long bytes;	// ... for this many bytes, a decaying average
+  } cost;
 
 #ifdef HAVE_ZLIB
   z_stream *strm;
-  z_stream streams[5];
+  z_stream streams[5];	// 0: zrle, 1..4: tight
+  int zlib_ready;
+  unsigned char *tight_in;	// compressed data of one rectangle
+  int tight_in_size;
+  unsigned char *tight_buf;	// decompressed data of one rectangle
+  int tight_buf_size;
+  int tight_jpeg_seen;
 #endif
 
+  struct {
+        long long bytes;		// everything read from the server
+        long updates;
+        long skipped;		// updates decoded but never shown
+        long long enc_bytes[32];	// per encoding type < 32
+        long enc_rects[32];
+  } stats;
+
   struct {
         int incremental;
         u_int16_t x;
@@ -200,40 +451,115 @@ typedef struct VncConnectionPrivate
         u_int16_t height;
   } lastUpdateRequest;
 
+#ifdef HAVE_PTHREAD
+  struct VncDecodePool *pool;	// NULL: decode inline
+#endif
 } VncConnectionPrivate;
 
-typedef struct VncConnection
-{
-  int fd;
+/*
+ * rgb/stride address the whole framebuffer, view selects the region to show.
+ * dirty is relative to view->x,y and never empty.
+ */
+typedef int (*VncExposeFunc)(VncView *view, unsigned char *rgb, int stride, VncRect *dirty, void *expose_cb_data);
+
+/*
+ * Pan engine: the view glides along waypoints (eased in and out), or
+ * moves at a constant velocity, computed from the clock at fps.
+ */
+#define VNC_PAN_POINTS	16
 
-  int fifo;
+typedef struct VncPan
+{
+  int n;			// waypoints, 0 when idle
+  int i;			// the one we are heading for
+  int px[VNC_PAN_POINTS], py[VNC_PAN_POINTS], ms[VNC_PAN_POINTS];
+  int loop;
+  int vx, vy;			// px/s, when n == 0
+  int x0, y0;			// start of the current segment
+  long long t0;			// usec, start of the current segment
+  int fps;
+  long long next_frame;		// usec
+} VncPan;
 
+typedef struct VncConnection
+{
+  int fd;		// -1 while offline
+  int record;		// VNC_TINY_RECORD, a copy of everything read, or -1
+  int replay;		// fd is a recording, writes go nowhere
+  char *host;
+  char *port;
+  struct sockaddr_storage addr;	// last address connected to, tried first
+  socklen_t addrlen;		// 0: resolve host
+  int backoff_ms;	// reconnect delay, doubles on each failure
+  long long next_retry;	// usec, or the connect() deadline while connecting
+  int async;		// reconnect without blocking, see vnc_connection_connecting()
+  int connecting;	// 1: connect() in progress, 2: waiting for the server version
+  unsigned char *offline_rgb;	// fallback animation while disconnected
+  int offline_n;
+  int offline_frame;
+  long long next_offline_frame;
+
+  struct VncCtl *ctl;	// control socket and fifo, or NULL
+
+  char *encodings;	// VNC_TINY_ENCODINGS or "set encodings"
   int msec_refresh;
-  VncView view;
-
-  int (*expose_cb)(VncView *view, unsigned char *rgb, int stride, void *expose_cb_data);
+  int latency_ms;	// budget from server to panel, VNC_TINY_LATENCY
+  int stats_every;	// print stats every n updates
+  long long next_refresh;	// usec, when polled without select timeout
+  VncView view;		// source rectangle on the remote desktop
+  int margin;		// VNC_TINY_MARGIN, pixels cached around the view
+  VncRect track;	// view plus margin, what the server keeps us updated on
+  VncPan pan;
+
+  VncView panel;	// what expose_cb sees when view is scaled
+  VncScaler scaler;
+  unsigned char *panel_rgb;
+
+  VncExposeFunc expose_cb;
   void *expose_cb_data;
 
+#ifdef HAVE_PTHREAD
+  int threads;		// VNC_TINY_THREADS, decoding threads including ours
+#endif
   VncConnectionPrivate *priv;
 } VncConnection;
 
 
-// FROM /usr/include/glib-2.0/glib/gmacros.h
-#define FALSE (0)
-#define TRUE  (!FALSE)
-// FROM /usr/include/glib-2.0/glib/gtypes.h
-#define G_BIG_ENDIAN	4321
-#define G_LITTLE_ENDIAN	1234
+// returns a connected socket or -1, after at most sec seconds.
+static int vnc_connection_socket(struct sockaddr *addr, socklen_t addrlen, int sec)
+{
+  struct timeval tval = { sec, 0 };	// a stalled server must not block us forever
+  int sfd = socket(addr->sa_family, SOCK_STREAM, 0);
+
+  if (sfd == -1)
+    return -1;
+  setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+  setsockopt(sfd, SOL_SOCKET, SO_SNDTIMEO, &tval, sizeof(tval));	// also bounds connect()
+  if (connect(sfd, addr, addrlen) != -1)
+    return sfd;
+  close(sfd);
+  return -1;
+}
 
 // FROM man getaddrinfo
-VncConnection *connect_vnc_server(char *hostname, char *str_port)
+// returns a connected socket or -1.
+// *addr is tried first if *addrlen is set, and holds the address used.
+int vnc_connection_open(char *hostname, char *str_port, struct sockaddr_storage *addr, socklen_t *addrlen)
 {
   struct addrinfo hints;
   struct addrinfo *result, *rp;
-  int sfd, s;
+  int sfd = -1, s;
 
   if (!str_port) str_port = "5900";
 
+  if (*addrlen > 0)
+    {
+      // no DNS on the way, the server rarely moves.
+      if ((sfd = vnc_connection_socket((struct sockaddr *)addr, *addrlen, 2)) >= 0)
+        return sfd;
+      *addrlen = 0;
+    }
+
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_family = AF_INET;    /* Allow IPv4 or IPv6 */
   hints.ai_socktype = SOCK_STREAM;
@@ -244,52 +570,77 @@ VncConnection *connect_vnc_server(char *hostname, char *str_port)
   if (s != 0)
     {
       fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-      exit(EXIT_FAILURE);
+      return -1;
     }
 
   for (rp = result; rp != NULL; rp = rp->ai_next)
     {
-      sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-      if (sfd == -1) continue;
-
-      if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1) break;                  /* Success */
-
-      close(sfd);
+      sfd = vnc_connection_socket(rp->ai_addr, rp->ai_addrlen, 10);
+      if (sfd != -1) break;                  /* Success */
     }
 
   if (rp == NULL)
     {               /* No address succeeded */
-      fprintf(stderr, "Could not connect\n");
-      exit(EXIT_FAILURE);
+      fprintf(stderr, "Could not connect to %s:%s\n", hostname, str_port);
+    }
+  else if (rp->ai_addrlen <= sizeof(*addr))
+    {
+      memcpy(addr, rp->ai_addr, rp->ai_addrlen);
+      *addrlen = rp->ai_addrlen;
     }
 
   freeaddrinfo(result);           /* No longer needed */
+  return sfd;
+}
 
-  static VncConnection conn;
-  static VncConnectionPrivate priv;
-
-  conn.view.x = 0;
-  conn.view.y = 0;
-  conn.view.w = 32;
-  conn.view.h = 32;
-  conn.view.moved = 1;		// start with a full update request
-  conn.expose_cb = NULL;
-  conn.expose_cb_data = NULL;
-  priv.rgb = NULL;
-  priv.sharedFlag = TRUE;
-  priv.has_error = FALSE;
-  conn.priv = &priv;
-  conn.fd = sfd;
-  conn.msec_refresh = 200;
-  conn.fifo = -1;
-
-  if (getenv("VNC_TINY_CFG"))
-    {
-      char *fifo = getenv("VNC_TINY_CFG");
-      mkfifo(fifo, 0777);
-      conn.fifo = open(fifo, O_RDONLY|O_NONBLOCK);
-    }
-  return &conn;
+// the connection is made by the first vnc_connection_offline() call.
+VncConnection *connect_vnc_server(char *hostname, char *str_port)
+{
+  VncConnection *conn = (VncConnection *)calloc(1, sizeof(VncConnection));
+  VncConnectionPrivate *priv = (VncConnectionPrivate *)calloc(1, sizeof(VncConnectionPrivate));
+
+  conn->host = strdup(hostname);
+  conn->port = str_port ? strdup(str_port) : NULL;
+  conn->view.x = 0;
+  conn->view.y = 0;
+  conn->view.w = 32;
+  conn->view.h = 32;
+  conn->view.moved = 1;		// start with a full update request
+  conn->margin = getenv("VNC_TINY_MARGIN") ? atoi(getenv("VNC_TINY_MARGIN")) : 0;
+  memset(&conn->track, 0, sizeof(conn->track));
+  memset(&conn->pan, 0, sizeof(conn->pan));
+  conn->pan.fps = getenv("VNC_TINY_FPS") ? atoi(getenv("VNC_TINY_FPS")) : 30;
+  conn->panel = conn->view;
+  conn->panel.moved = 0;
+  conn->panel_rgb = NULL;
+  conn->expose_cb = NULL;
+  conn->expose_cb_data = NULL;
+  priv->rgb = NULL;
+  priv->sharedFlag = TRUE;
+  priv->has_error = FALSE;
+  conn->priv = priv;
+  conn->msec_refresh = 200;
+  conn->latency_ms = getenv("VNC_TINY_LATENCY") ? atoi(getenv("VNC_TINY_LATENCY")) : 200;
+  conn->next_refresh = 0;
+  conn->ctl = NULL;
+  conn->encodings = getenv("VNC_TINY_ENCODINGS") ? strdup(getenv("VNC_TINY_ENCODINGS")) : NULL;
+  conn->backoff_ms = 0;
+  conn->next_retry = 0;
+  conn->async = FALSE;
+  conn->connecting = 0;
+  conn->stats_every = getenv("VNC_TINY_STATS") ? atoi(getenv("VNC_TINY_STATS")) : 0;
+#ifdef HAVE_PTHREAD
+  conn->threads = getenv("VNC_TINY_THREADS") ? atoi(getenv("VNC_TINY_THREADS")) : sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  conn->fd = -1;
+  conn->addrlen = 0;
+  conn->record = -1;
+  conn->replay = FALSE;
+  priv->has_error = TRUE;	// not connected yet
+  conn->offline_rgb = NULL;
+  conn->offline_n = 0;
+
+  return conn;
 }
 
 
@@ -301,6 +652,7 @@ int vnc_connection_flush(VncConnection *conn)
 
 int vnc_connection_read(VncConnection *conn, char *buf, int len)
 {
+  char *start = buf;
   int rr = 0;
   while (len > 0)
     {
@@ -314,6 +666,13 @@ int vnc_connection_read(VncConnection *conn, char *buf, int len)
       buf += r;
       rr += r;
     }
+  conn->priv->stats.bytes += rr;
+  if (conn->record >= 0 && write(conn->record, start, rr) != rr)
+    {
+      perror("VNC_TINY_RECORD");
+      close(conn->record);
+      conn->record = -1;
+    }
   return rr;
 }
 
@@ -353,6 +712,8 @@ int32_t vnc_connection_read_s32(VncConnection *conn)
 int vnc_connection_write(VncConnection *conn, char *buf, int len)
 {
   int rr = 0;
+  if (conn->replay)
+    return len;
   while (len > 0)
     {
       int r = write(conn->fd, buf, len);
@@ -404,6 +765,14 @@ typedef enum {
     VNC_CONNECTION_ENCODING_HEXTILE = 5,
     VNC_CONNECTION_ENCODING_TIGHT = 7,
     VNC_CONNECTION_ENCODING_ZRLE = 16,
+
+    VNC_CONNECTION_ENCODING_TIGHT_JPEG0 = -32,
+    VNC_CONNECTION_ENCODING_DESKTOP_RESIZE = -223,
+    VNC_CONNECTION_ENCODING_LAST_RECT = -224,
+    VNC_CONNECTION_ENCODING_COMPRESS_LEVEL0 = -256,
+    VNC_CONNECTION_ENCODING_EXTENDED_DESKTOP_RESIZE = -308,
+    VNC_CONNECTION_ENCODING_FENCE = -312,
+    VNC_CONNECTION_ENCODING_CONTINUOUS_UPDATES = -313,
 } VncConnectionEncoding;
 
 // FROM gtk-vnc/src/vncconnection.c
@@ -413,6 +782,8 @@ typedef enum {
     VNC_CONNECTION_SERVER_MESSAGE_SET_COLOR_MAP_ENTRIES = 1,
     VNC_CONNECTION_SERVER_MESSAGE_BELL = 2,
     VNC_CONNECTION_SERVER_MESSAGE_SERVER_CUT_TEXT = 3,
+    VNC_CONNECTION_SERVER_MESSAGE_END_OF_CONTINUOUS_UPDATES = 150,
+    VNC_CONNECTION_SERVER_MESSAGE_FENCE = 248,
     VNC_CONNECTION_SERVER_MESSAGE_QEMU = 255,
 } VncConnectionServerMessage;
 
@@ -423,9 +794,16 @@ typedef enum {
     VNC_CONNECTION_CLIENT_MESSAGE_KEY = 4,
     VNC_CONNECTION_CLIENT_MESSAGE_POINTER = 5,
     VNC_CONNECTION_CLIENT_MESSAGE_CUT_TEXT = 6,
+    VNC_CONNECTION_CLIENT_MESSAGE_ENABLE_CONTINUOUS_UPDATES = 150,
+    VNC_CONNECTION_CLIENT_MESSAGE_FENCE = 248,
     VNC_CONNECTION_CLIENT_MESSAGE_QEMU = 255,
 } VncConnectionClientMessage;
 
+#define VNC_CONNECTION_FENCE_BLOCK_BEFORE	(1 << 0)
+#define VNC_CONNECTION_FENCE_BLOCK_AFTER	(1 << 1)
+#define VNC_CONNECTION_FENCE_SYNC_NEXT		(1 << 2)
+#define VNC_CONNECTION_FENCE_REQUEST		(1U << 31)
+
 static int vnc_connection_before_version (VncConnection *conn, int major, int minor)
 {
   VncConnectionPrivate *priv = conn->priv;
@@ -484,7 +862,7 @@ int vnc_connection_check_auth_result(VncConnection *conn)
       char reason[1024];
       int len = vnc_connection_read_u32(conn);
 
-      if (len < 1 || len >= sizeof(reason)) { fprintf(stderr, "auth error: unkonw\n"); exit(4); }
+      if (len < 1 || len >= sizeof(reason)) { fprintf(stderr, "auth error: unkonw\n"); return FALSE; }
       vnc_connection_read(conn, reason, len);
       reason[len] = '\0';
       fprintf(stderr, "auth error: Server says: %s\n", reason);
@@ -502,11 +880,23 @@ int vnc_connection_perform_auth(VncConnection *conn)
   if (priv->minor <= 6) {
     nauth = 1;
     auth[0] = vnc_connection_read_u32(conn);
+    if (auth[0] == 0) {
+      // connection failed, with a reason.
+      char reason[1024];
+      u_int32_t len = vnc_connection_read_u32(conn);
+
+      if (len >= sizeof(reason)) len = sizeof(reason) - 1;
+      vnc_connection_read(conn, reason, len);
+      reason[len] = '\0';
+      fprintf(stderr, "auth error: Server says: %s\n", reason);
+      return FALSE;
+    }
+    if (auth[0] != VNC_CONNECTION_AUTH_NONE) { fprintf(stderr, "auth_type=%d not implemented, only 1 (none)\n", auth[0]); return FALSE; }
   } else {
     int auth_type_none_seen = 0;
     nauth = vnc_connection_read_u8(conn);
     if (nauth == 0) { fprintf(stderr, "Connection refused or already connected?\n"); }
-    if (nauth < 1 || nauth > 10) { fprintf(stderr, "nauth=%d out of range [1..10]\n", nauth); exit(2); }
+    if (nauth < 1 || nauth > 10) { fprintf(stderr, "nauth=%d out of range [1..10]\n", nauth); return FALSE; }
     for (i = 0 ; i < nauth ; i++)
       {
         auth[i] = vnc_connection_read_u8(conn);
@@ -526,11 +916,202 @@ int vnc_connection_perform_auth(VncConnection *conn)
   return TRUE;
 }
 
+/*
+ * Pixel conversion kernels, one per common server format, with all byte
+ * offsets and shifts known at compile time. vnc_blt_select() picks one
+ * when the pixel format arrives, vnc_blt_generic() handles the rest.
+ * Compile with -mssse3 (x86) or -mfpu=neon (arm) for SIMD 32 bpp kernels.
+ */
+#if defined(__SSSE3__)
+# include <tmmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+static void vnc_blt_generic(const VncPixelFormat *fmt, const u_int8_t *src, unsigned char *rgb, int n)
+{
+  int rmax = fmt->red_max   ? fmt->red_max   : 1;
+  int gmax = fmt->green_max ? fmt->green_max : 1;
+  int bmax = fmt->blue_max  ? fmt->blue_max  : 1;
+  int be = (fmt->byte_order == G_BIG_ENDIAN);
+  u_int32_t v;
+
+  while (n-- > 0)
+    {
+      switch (fmt->bits_per_pixel)
+        {
+        case 8:  v = src[0]; src += 1; break;
+        case 16: v = be ? (src[0] << 8) | src[1] : src[0] | (src[1] << 8); src += 2; break;
+        default: v = be ? (src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3]
+                        : src[0] | (src[1] << 8) | (src[2] << 16) | ((u_int32_t)src[3] << 24); src += 4; break;
+        }
+      *rgb++ = ((v >> fmt->red_shift)   & fmt->red_max)   * 255 / rmax;
+      *rgb++ = ((v >> fmt->green_shift) & fmt->green_max) * 255 / gmax;
+      *rgb++ = ((v >> fmt->blue_shift)  & fmt->blue_max)  * 255 / bmax;
+    }
+}
+
+// returns how many pixels were done, the caller does the rest.
+static inline int vnc_blt32_simd(const u_int8_t *src, unsigned char *rgb, int n, int r, int g, int b)
+{
+  int i = 0;
+#if defined(__SSSE3__)
+  const __m128i shuf = _mm_setr_epi8(r, g, b, 4+r, 4+g, 4+b, 8+r, 8+g, 8+b, 12+r, 12+g, 12+b, -1, -1, -1, -1);
+
+  // 16 byte stores of 12 valid bytes, keep the last 6 pixels for the tail.
+  for (; i + 6 <= n; i += 4)
+    _mm_storeu_si128((__m128i *)(rgb + 3*i),
+                     _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 4*i)), shuf));
+#elif defined(__ARM_NEON)
+  for (; i + 16 <= n; i += 16)
+    {
+      uint8x16x4_t in = vld4q_u8(src + 4*i);
+      uint8x16x3_t out;
+      out.val[0] = in.val[r];
+      out.val[1] = in.val[g];
+      out.val[2] = in.val[b];
+      vst3q_u8(rgb + 3*i, out);
+    }
+#endif
+  return i;
+}
+
+// r, g, b: byte offset of each channel within the 4 byte pixel in memory.
+#define VNC_BLT32(name, r, g, b)							\
+static void name(const VncPixelFormat *fmt, const u_int8_t *src, unsigned char *rgb, int n)	\
+{											\
+  int i = vnc_blt32_simd(src, rgb, n, r, g, b);						\
+  src += 4*i; rgb += 3*i;								\
+  for (; i < n; i++, src += 4)								\
+    {											\
+      *rgb++ = src[r];									\
+      *rgb++ = src[g];									\
+      *rgb++ = src[b];									\
+    }											\
+}
+
+// the constant divisions below compile to multiplications.
+#define VNC_BLT16(name, be, rs, rmax, gs, gmax, bs, bmax)				\
+static void name(const VncPixelFormat *fmt, const u_int8_t *src, unsigned char *rgb, int n)	\
+{											\
+  while (n-- > 0)									\
+    {											\
+      unsigned int v = be ? (src[0] << 8) | src[1] : src[0] | (src[1] << 8);		\
+      src += 2;										\
+      *rgb++ = ((v >> rs) & rmax) * 255 / rmax;						\
+      *rgb++ = ((v >> gs) & gmax) * 255 / gmax;						\
+      *rgb++ = ((v >> bs) & bmax) * 255 / bmax;						\
+    }											\
+}
+
+#define VNC_BLT8(name, rs, rmax, gs, gmax, bs, bmax)					\
+static void name(const VncPixelFormat *fmt, const u_int8_t *src, unsigned char *rgb, int n)	\
+{											\
+  while (n-- > 0)									\
+    {											\
+      unsigned int v = *src++;								\
+      *rgb++ = ((v >> rs) & rmax) * 255 / rmax;						\
+      *rgb++ = ((v >> gs) & gmax) * 255 / gmax;						\
+      *rgb++ = ((v >> bs) & bmax) * 255 / bmax;						\
+    }											\
+}
+
+VNC_BLT32(vnc_blt_bgrx, 2, 1, 0)	// shifts 16 8 0, little endian (x11vnc default)
+VNC_BLT32(vnc_blt_rgbx, 0, 1, 2)	// shifts 0 8 16, little endian
+VNC_BLT32(vnc_blt_xrgb, 1, 2, 3)	// shifts 16 8 0, big endian
+VNC_BLT32(vnc_blt_xbgr, 3, 2, 1)	// shifts 0 8 16, big endian
+VNC_BLT16(vnc_blt_rgb565le, 0, 11, 31, 5, 63, 0, 31)
+VNC_BLT16(vnc_blt_rgb565be, 1, 11, 31, 5, 63, 0, 31)
+VNC_BLT8(vnc_blt_rgb332, 5, 7, 2, 7, 0, 3)
+VNC_BLT8(vnc_blt_bgr233, 0, 7, 3, 7, 6, 3)	// the classic vnc 8 bit format
+
+static const struct
+{
+  const char *name;
+  VncPixelFormat fmt;	// byte_order does not matter for 8 bpp
+  VncBltFunc blt;
+} vnc_blt_kernels[] =
+{
+  { "bgrx",     { 32, 24, G_LITTLE_ENDIAN, 1, 255, 255, 255, 16,  8,  0 }, vnc_blt_bgrx },
+  { "rgbx",     { 32, 24, G_LITTLE_ENDIAN, 1, 255, 255, 255,  0,  8, 16 }, vnc_blt_rgbx },
+  { "xrgb",     { 32, 24, G_BIG_ENDIAN,    1, 255, 255, 255, 16,  8,  0 }, vnc_blt_xrgb },
+  { "xbgr",     { 32, 24, G_BIG_ENDIAN,    1, 255, 255, 255,  0,  8, 16 }, vnc_blt_xbgr },
+  { "rgb565le", { 16, 16, G_LITTLE_ENDIAN, 1,  31,  63,  31, 11,  5,  0 }, vnc_blt_rgb565le },
+  { "rgb565be", { 16, 16, G_BIG_ENDIAN,    1,  31,  63,  31, 11,  5,  0 }, vnc_blt_rgb565be },
+  { "rgb332",   {  8,  8, G_LITTLE_ENDIAN, 1,   7,   7,   3,  5,  2,  0 }, vnc_blt_rgb332 },
+  { "bgr233",   {  8,  8, G_LITTLE_ENDIAN, 1,   7,   7,   3,  0,  3,  6 }, vnc_blt_bgr233 },
+};
+
+static VncBltFunc vnc_blt_select(const VncPixelFormat *fmt, const char **name)
+{
+  int i;
+
+  if (!fmt->true_color_flag ||
+      (fmt->bits_per_pixel != 8 && fmt->bits_per_pixel != 16 && fmt->bits_per_pixel != 32))
+    return NULL;
+  for (i = 0; i < sizeof(vnc_blt_kernels)/sizeof(vnc_blt_kernels[0]); i++)
+    {
+      const VncPixelFormat *k = &vnc_blt_kernels[i].fmt;
+
+      if (k->bits_per_pixel == fmt->bits_per_pixel &&
+          (k->byte_order == fmt->byte_order || k->bits_per_pixel == 8) &&
+          k->red_max == fmt->red_max && k->green_max == fmt->green_max && k->blue_max == fmt->blue_max &&
+          k->red_shift == fmt->red_shift && k->green_shift == fmt->green_shift && k->blue_shift == fmt->blue_shift)
+        {
+          *name = vnc_blt_kernels[i].name;
+          return vnc_blt_kernels[i].blt;
+        }
+    }
+  *name = "generic";
+  return vnc_blt_generic;
+}
+
+// vnc_tiny_view --bench-blit: Mpixel/s of each kernel and of the generic path.
+int vnc_blt_bench(void)
+{
+  int w = 640, h = 480, frames = 200;
+  u_int8_t *src = (u_int8_t *)malloc(4 * w * h);
+  unsigned char *rgb = (unsigned char *)malloc(3 * w * h);
+  unsigned char *ref = (unsigned char *)malloc(3 * w * h);
+  int i, j, f;
+
+  for (i = 0; i < 4 * w * h; i++)
+    src[i] = rand();
+  for (i = 0; i < sizeof(vnc_blt_kernels)/sizeof(vnc_blt_kernels[0]); i++)
+    {
+      const VncPixelFormat *fmt = &vnc_blt_kernels[i].fmt;
+      int bpp = fmt->bits_per_pixel / 8;
+      double mpix[2];
+
+      for (j = 0; j < 2; j++)
+        {
+          VncBltFunc blt = j ? vnc_blt_generic : vnc_blt_kernels[i].blt;
+          long long t0 = now_usec();
+
+          for (f = 0; f < frames; f++)
+            {
+              int y;
+              for (y = 0; y < h; y++)
+                blt(fmt, src + y * w * bpp, (j ? ref : rgb) + 3 * y * w, w);
+            }
+          mpix[j] = (double)w * h * frames / (now_usec() - t0 + 1);
+        }
+      printf("%-10s %8.1f Mpixel/s   generic %8.1f Mpixel/s%s\n", vnc_blt_kernels[i].name,
+             mpix[0], mpix[1], memcmp(rgb, ref, 3 * w * h) ? "   MISMATCH" : "");
+    }
+  free(src); free(rgb); free(ref);
+  return 0;
+}
+
 int vnc_connection_initialize(VncConnection *conn)
 {
   VncConnectionPrivate *priv = conn->priv;
   int ret;
   char version[13];
+  const char *blt_name;
+#ifdef HAVE_ZLIB
+  int i;
+#endif
 
   vnc_connection_read(conn, version, 12);
 
@@ -538,14 +1119,16 @@ int vnc_connection_initialize(VncConnection *conn)
   ret = sscanf(version, "RFB %03d.%03d\n", &priv->major, &priv->minor);
   if (ret != 2) {
         fprintf(stderr, "Error while parsing server version\n");
-	exit(2);
+        priv->has_error = TRUE;
+        return FALSE;
   }
 
   fprintf(stderr, "Server version: %d.%d\n", priv->major, priv->minor);
 
   if (vnc_connection_before_version(conn, 3, 3)) {
         fprintf(stderr, "Server version is not supported (%d.%d)\n", priv->major, priv->minor);
-        exit(3);
+        priv->has_error = TRUE;
+        return FALSE;
     } else if (vnc_connection_before_version(conn, 3, 7)) {
         priv->minor = 3;
     } else if (vnc_connection_after_version(conn, 3, 8)) {
@@ -559,7 +1142,9 @@ int vnc_connection_initialize(VncConnection *conn)
   fprintf(stderr, "Using version: %d.%d\n", priv->major, priv->minor);
 
   if (!vnc_connection_perform_auth(conn)) {
-        fprintf(stderr,"Auth failed\n"); exit(4);
+        fprintf(stderr,"Auth failed\n");
+        priv->has_error = TRUE;
+        return FALSE;
   }
   printf("authentication successful\n");
   vnc_connection_write_u8(conn, priv->sharedFlag);	// "\1"
@@ -567,17 +1152,43 @@ int vnc_connection_initialize(VncConnection *conn)
 
   priv->width = vnc_connection_read_u16(conn);	// "\0@"
   priv->height = vnc_connection_read_u16(conn);	// "\0@"
+  priv->cu_supported = FALSE;
+  priv->cu_active = FALSE;
+  priv->fence_supported = FALSE;
+  priv->fence_sent = 0;
+  priv->fence_next = 0;
+  priv->latency = 0;
+  priv->throttled_until = 0;
 
   if (vnc_connection_has_error(conn))
     return FALSE;
   fprintf(stderr, "Initial desktop size %dx%d\n", priv->width, priv->height);
-  priv->rgb = (unsigned char *)calloc(3*priv->width, priv->height);
+  if (priv->rgb && priv->width == priv->fb_width && priv->height == priv->fb_height)
+    {
+      priv->fb_reused = TRUE;	// reconnected, keep what we have
+    }
+  else
+    {
+      free(priv->rgb);
+      priv->rgb = (unsigned char *)calloc(3*priv->width, priv->height);
+      priv->fb_width = priv->width;
+      priv->fb_height = priv->height;
+      priv->fb_reused = FALSE;
+    }
 
   vnc_connection_read_pixel_format(conn, &priv->fmt);
+  if (!(priv->blt = vnc_blt_select(&priv->fmt, &blt_name)))
+    {
+      fprintf(stderr, "Pixel format not supported (no true color)\n");
+      priv->has_error = TRUE;
+      return FALSE;
+    }
+  fprintf(stderr, "Using %s pixel conversion\n", blt_name);
 
   int n_name = vnc_connection_read_u32(conn);
   if (n_name > 4096)
     return FALSE;
+  free(priv->name);
   priv->name = (char *)calloc(sizeof(char), n_name + 1);
 
   vnc_connection_read(conn, priv->name, n_name);
@@ -588,11 +1199,15 @@ int vnc_connection_initialize(VncConnection *conn)
     return FALSE;
 
 #ifdef HAVE_ZLIB
+  if (priv->zlib_ready)
+    for (i = 0; i < 5; i++)
+      inflateEnd(&priv->streams[i]);	// left over from before a reconnect
   memset(&priv->streams, 0, sizeof(priv->streams));	// typo in gtk-vnc/src/vncconnection?
   /* FIXME what level? */
   for (i = 0; i < 5; i++)
     inflateInit(&priv->streams[i]);
   priv->strm = NULL;
+  priv->zlib_ready = TRUE;
 #endif
 
   return TRUE;
@@ -615,42 +1230,121 @@ static int vnc_connection_validate_boundary(VncConnection *conn,
 
 static void vnc_framebuffer_copyrect(VncConnectionPrivate *priv, int sx, int sy, int x, int y, int w, int h)
 {
-  // NOT impl.
-  fprintf(stderr, "r");
+  int stride = 3*priv->width;
+  int j;
+
+  // bottom up when moving down, memmove() handles the overlap within a row.
+  if (sy < y)
+    for (j = h - 1; j >= 0; j--)
+      memmove(priv->rgb + (y + j)*stride + 3*x, priv->rgb + (sy + j)*stride + 3*sx, 3*w);
+  else
+    for (j = 0; j < h; j++)
+      memmove(priv->rgb + (y + j)*stride + 3*x, priv->rgb + (sy + j)*stride + 3*sx, 3*w);
 }
 
-static void vnc_framebuffer_blt(VncConnectionPrivate *priv, u_int8_t *dst, int d, int x, int y, int w, int h)
+static void vnc_framebuffer_blt(VncConnectionPrivate *priv, u_int8_t *src, int x, int y, int w, int h)
 {
   // may see multiple calls per update
   unsigned char *rgb = priv->rgb + x*3 + y*priv->width*3;
-  if (priv->fmt.bits_per_pixel == 32)
-    {
-      u_int32_t *src = (u_int32_t *)dst;
-      while (h-- > 0)
-        {
-          for (x = 0; x < w; x++)
-	    {
-	      u_int32_t v = *src++;
-	      *rgb++ = (v>>priv->fmt.red_shift) & 0xff;
-	      *rgb++ = (v>>priv->fmt.green_shift) & 0xff;
-	      *rgb++ = (v>>priv->fmt.blue_shift) & 0xff;
-	    }
-          rgb += priv->width*3 - w*3;
-        }
-    }
-  else
+  int bpp = priv->fmt.bits_per_pixel / 8;
+
+  while (h-- > 0)
     {
-      fprintf(stderr, "vnc_framebuffer_blt fmt.bits_per_pixel=%d not implemented\n", priv->fmt.bits_per_pixel);
-      exit(11);
+      priv->blt(&priv->fmt, src, rgb, w);
+      src += w * bpp;
+      rgb += priv->width*3;
     }
-  // fprintf(stderr, "b");
 }
 
 static void vnc_connection_update(VncConnection *conn, int x, int y, int w, int h)
 {
   // always called one per updated
   // fprintf(stderr, "vnc_connection_update, x,y=%d,%d w,h=%d,%d\n", x,y,w,h);
-  conn->expose_cb(&(conn->view), conn->priv->rgb, 3*conn->priv->width, conn->expose_cb_data);
+  VncConnectionPrivate *priv = conn->priv;
+  VncView *view = &conn->view;
+  int stride = 3*priv->width;
+
+  if (x < view->x) { w -= view->x - x; x = view->x; }
+  if (y < view->y) { h -= view->y - y; y = view->y; }
+  if (x + w > view->x + view->w) w = view->x + view->w - x;
+  if (y + h > view->y + view->h) h = view->y + view->h - y;
+  if (w <= 0 || h <= 0)
+    return;
+
+  if (view->w == conn->panel.w && view->h == conn->panel.h)
+    {
+      vnc_rect_union(&priv->dirty, x - view->x, y - view->y, w, h);
+      return;
+    }
+
+  // scaled view: re-filter only the panel pixels covered by this rectangle.
+  if (!vnc_scaler_init(&conn->scaler, view->w, view->h, conn->panel.w, conn->panel.h))
+    return;
+  if (!conn->panel_rgb)
+    conn->panel_rgb = (unsigned char *)calloc(3*conn->panel.w, conn->panel.h);
+  vnc_scaler_rect(&conn->scaler, priv->rgb + view->y*stride + view->x*3, stride,
+                  conn->panel_rgb, 3*conn->panel.w, 3, x - view->x, y - view->y, w, h, &priv->dirty);
+}
+
+// hand everything collected by vnc_connection_update() to expose_cb.
+static int vnc_connection_expose(VncConnection *conn)
+{
+  VncConnectionPrivate *priv = conn->priv;
+  VncRect dirty = priv->dirty;
+
+  if (dirty.w <= 0 || dirty.h <= 0)
+    return FALSE;		// nothing intersected the view
+  memset(&priv->dirty, 0, sizeof(priv->dirty));
+
+  if (conn->view.w == conn->panel.w && conn->view.h == conn->panel.h)
+    return conn->expose_cb(&conn->view, priv->rgb, 3*priv->width, &dirty, conn->expose_cb_data);
+  return conn->expose_cb(&conn->panel, conn->panel_rgb, 3*conn->panel.w, &dirty, conn->expose_cb_data);
+}
+
+// show the whole view again, e.g. after the output changed.
+static int vnc_connection_redraw(VncConnection *conn)
+{
+  if (!conn->priv->rgb || !conn->expose_cb)
+    return FALSE;
+  vnc_connection_update(conn, conn->view.x, conn->view.y, conn->view.w, conn->view.h);
+  return vnc_connection_expose(conn);
+}
+
+// keep the view inside the remote desktop.
+void vnc_connection_clamp_view(VncConnection *conn)
+{
+  VncView *view = &conn->view;
+  VncConnectionPrivate *priv = conn->priv;
+
+  if (!priv->width || !priv->height)
+    return;		// not connected yet
+
+  if (view->w > priv->width)  view->w = priv->width;
+  if (view->h > priv->height) view->h = priv->height;
+  if (view->w < 1) view->w = 1;
+  if (view->h < 1) view->h = 1;
+  if (view->x + view->w > priv->width)  view->x = priv->width  - view->w;
+  if (view->y + view->h > priv->height) view->y = priv->height - view->h;
+  if (view->x < 0) view->x = 0;
+  if (view->y < 0) view->y = 0;
+}
+
+// DesktopSize: the server changed the size of the remote desktop.
+static void vnc_connection_resize(VncConnection *conn, int width, int height)
+{
+  VncConnectionPrivate *priv = conn->priv;
+
+  if (width < 1 || height < 1 || (width == priv->width && height == priv->height))
+    return;
+  fprintf(stderr, "Desktop resized to %dx%d\n", width, height);
+  free(priv->rgb);
+  priv->rgb = (unsigned char *)calloc(3*width, height);
+  priv->width = priv->fb_width = width;
+  priv->height = priv->fb_height = height;
+  memset(&priv->dirty, 0, sizeof(priv->dirty));
+
+  vnc_connection_clamp_view(conn);
+  conn->view.moved = 1;		// everything is new, ask for a full update
 }
 
 static void vnc_connection_raw_update(VncConnection *conn,
@@ -671,31 +1365,478 @@ static void vnc_connection_raw_update(VncConnection *conn,
     for (i = 0; i < height; i++)
       {
             vnc_connection_read(conn, (char *)dst, width * (priv->fmt.bits_per_pixel / 8));
-            vnc_framebuffer_blt(priv, dst, 0, x, y + i, width, 1);
+            vnc_framebuffer_blt(priv, dst, x, y + i, width, 1);
       }
     free(dst);
 }
 
+#ifdef HAVE_PTHREAD
+/*
+ * Parallel decode: raw rectangles are read whole and cut into bands of
+ * VNC_DECODE_BAND rows. Workers, and the reader while it waits in
+ * vnc_decode_join(), take the next band as soon as they are free. Whatever
+ * depends on earlier rectangles (any other encoding, an overlap) joins
+ * first, and the scaler runs after the join, so the one expose per update
+ * sees the same framebuffer as the serial path. With VNC_TINY_THREADS=1,
+ * or on one cpu, there is no pool and nothing changes.
+ */
+#define VNC_DECODE_BAND	16	// rows per work item
+#define VNC_DECODE_JOBS	64	// rectangles in flight before a join
+#define VNC_DECODE_MIN	4096	// pixels, smaller rectangles decode inline
 
-static void vnc_connection_copyrect_update(VncConnection *conn,
-                                           u_int16_t dst_x, u_int16_t dst_y,
-                                           u_int16_t width, u_int16_t height)
+typedef struct VncDecodeJob
 {
-    VncConnectionPrivate *priv = conn->priv;
-    int src_x, src_y;
+  u_int8_t *src;		// the rectangle as read, reused
+  int size;
+  int x, y, w, h;
+} VncDecodeJob;
 
-    src_x = vnc_connection_read_u16(conn);
-    src_y = vnc_connection_read_u16(conn);
+typedef struct VncDecodeItem
+{
+  int job, y, h;		// rows y .. y+h-1 of jobs[job]
+} VncDecodeItem;
 
-    vnc_framebuffer_copyrect(priv,
-                             src_x, src_y,
-                             dst_x, dst_y,
-                             width, height);
-}
+typedef struct VncDecodePool
+{
+  VncConnectionPrivate *priv;
+  pthread_mutex_t lock;		// guards items and the counters
+  pthread_cond_t work;		// new items
+  pthread_cond_t finished;	// done reached n_items
+  VncDecodeJob jobs[VNC_DECODE_JOBS];
+  int n_jobs;
+  VncRect pending;		// union of the jobs
+  VncDecodeItem *items;
+  int max_items, n_items;
+  int next;			// first item nobody took yet
+  int done;
+} VncDecodePool;
+
+// called with the lock held, returns with it held.
+static void vnc_decode_item(VncDecodePool *pool)
+{
+  VncDecodeItem it = pool->items[pool->next++];
+  VncDecodeJob *job = &pool->jobs[it.job];
+  int bpp = pool->priv->fmt.bits_per_pixel / 8;
+
+  pthread_mutex_unlock(&pool->lock);
+  vnc_framebuffer_blt(pool->priv, job->src + it.y * job->w * bpp, job->x, job->y + it.y, job->w, it.h);
+  pthread_mutex_lock(&pool->lock);
+  if (++pool->done == pool->n_items)
+    pthread_cond_signal(&pool->finished);
+}
+
+static void *vnc_decode_worker(void *data)
+{
+  VncDecodePool *pool = (VncDecodePool *)data;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+    {
+      while (pool->next >= pool->n_items)
+        pthread_cond_wait(&pool->work, &pool->lock);
+      vnc_decode_item(pool);
+    }
+  return NULL;
+}
+
+// *threads is lowered to what could be started, NULL if no worker was.
+static VncDecodePool *vnc_decode_pool(VncConnectionPrivate *priv, int *threads)
+{
+  VncDecodePool *pool = (VncDecodePool *)calloc(1, sizeof(VncDecodePool));
+  pthread_t tid;
+  int i, err = 0, started = 1;	// the reader helps out
+
+  pool->priv = priv;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  for (i = 1; i < *threads; i++)
+    if ((err = pthread_create(&tid, NULL, vnc_decode_worker, pool)) == 0)
+      {
+        pthread_detach(tid);
+        started++;
+      }
+  if (started < *threads)
+    fprintf(stderr, "pthread_create: %s, %d of %d threads\n", strerror(err), started, *threads);
+  *threads = started;
+  if (started < 2)
+    {
+      pthread_mutex_destroy(&pool->lock);
+      pthread_cond_destroy(&pool->work);
+      pthread_cond_destroy(&pool->finished);
+      free(pool);
+      return NULL;
+    }
+  fprintf(stderr, "Decoding on %d threads\n", started);
+  return pool;
+}
+
+// wait for all bands, then update the view in the order the rectangles came.
+static void vnc_decode_join(VncConnection *conn)
+{
+  VncDecodePool *pool = conn->priv->pool;
+  int i;
+
+  if (!pool || !pool->n_jobs)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  while (pool->next < pool->n_items)
+    vnc_decode_item(pool);	// help out
+  while (pool->done < pool->n_items)
+    pthread_cond_wait(&pool->finished, &pool->lock);
+  pool->next = pool->done = pool->n_items = 0;
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->n_jobs; i++)
+    vnc_connection_update(conn, pool->jobs[i].x, pool->jobs[i].y, pool->jobs[i].w, pool->jobs[i].h);
+  pool->n_jobs = 0;
+  memset(&pool->pending, 0, sizeof(pool->pending));
+}
+
+/*
+ * A rectangle must not be decoded before the ones it overlaps or depends on.
+ * One decoded inline also updates the view at once, and a scaled view reads
+ * whole boxes around it, which must not be half written by the workers.
+ */
+static void vnc_decode_order(VncConnection *conn, int32_t etype, int x, int y, int w, int h)
+{
+  VncDecodePool *pool = conn->priv->pool;
+  VncView *view = &conn->view;
+  VncRect r = { x, y, w, h };
+
+  if (!pool || !pool->n_jobs)
+    return;
+  if (etype != VNC_CONNECTION_ENCODING_RAW)
+    {
+      vnc_decode_join(conn);
+      return;
+    }
+  if (w * h < VNC_DECODE_MIN && (view->w != conn->panel.w || view->h != conn->panel.h))
+    {
+      int bw = (view->w + conn->panel.w - 1) / conn->panel.w;
+      int bh = (view->h + conn->panel.h - 1) / conn->panel.h;
+      r.x -= bw; r.w += 2*bw;
+      r.y -= bh; r.h += 2*bh;
+    }
+  if (vnc_rect_intersect(&pool->pending, &r, &r))
+    vnc_decode_join(conn);
+}
+
+// returns FALSE when the rectangle is better decoded inline.
+static int vnc_decode_raw(VncConnection *conn, int x, int y, int w, int h)
+{
+  VncConnectionPrivate *priv = conn->priv;
+  VncDecodePool *pool = priv->pool;
+  VncDecodeJob *job;
+  int size = w * h * (priv->fmt.bits_per_pixel / 8);
+  int i;
+
+  if (w * h < VNC_DECODE_MIN || conn->threads < 2)
+    return FALSE;
+  if (!pool && !(pool = priv->pool = vnc_decode_pool(priv, &conn->threads)))
+    return FALSE;		// no workers, conn->threads is 1 now
+  if (pool->n_jobs == VNC_DECODE_JOBS)
+    vnc_decode_join(conn);
+
+  job = &pool->jobs[pool->n_jobs];
+  if (job->size < size)
+    {
+      free(job->src);
+      job->src = (u_int8_t *)malloc(size);
+      job->size = size;
+    }
+  if (vnc_connection_read(conn, (char *)job->src, size) != size)
+    return TRUE;		// has_error is set
+  job->x = x;
+  job->y = y;
+  job->w = w;
+  job->h = h;
+  vnc_rect_union(&pool->pending, x, y, w, h);
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->n_items + h / VNC_DECODE_BAND + 1 > pool->max_items)
+    {
+      pool->max_items = 2 * (pool->n_items + h / VNC_DECODE_BAND + 1);
+      pool->items = (VncDecodeItem *)realloc(pool->items, pool->max_items * sizeof(VncDecodeItem));
+    }
+  for (i = 0; i < h; i += VNC_DECODE_BAND)
+    {
+      VncDecodeItem *it = &pool->items[pool->n_items++];
+      it->job = pool->n_jobs;
+      it->y = i;
+      it->h = h - i < VNC_DECODE_BAND ? h - i : VNC_DECODE_BAND;
+    }
+  pool->n_jobs++;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  return TRUE;
+}
+#endif
+
+static void vnc_connection_copyrect_update(VncConnection *conn,
+                                           u_int16_t dst_x, u_int16_t dst_y,
+                                           u_int16_t width, u_int16_t height)
+{
+    VncConnectionPrivate *priv = conn->priv;
+    int src_x, src_y;
+
+    src_x = vnc_connection_read_u16(conn);
+    src_y = vnc_connection_read_u16(conn);
+    if (!vnc_connection_validate_boundary(conn, src_x, src_y, width, height))
+        return;
+
+    vnc_framebuffer_copyrect(priv,
+                             src_x, src_y,
+                             dst_x, dst_y,
+                             width, height);
+}
+
+#ifdef HAVE_ZLIB
+/*
+ * Tight encoding, without the JPEG subencoding: we never announce a
+ * quality level unless VNC_TINY_QUALITY asks for it, and servers only
+ * send JPEG rectangles to clients that do.
+ */
+static int vnc_buffer_reserve(unsigned char **buf, int *size, int need)
+{
+  if (*size >= need)
+    return TRUE;
+  free(*buf);
+  *buf = (unsigned char *)malloc(need);
+  *size = *buf ? need : 0;
+  return *buf != NULL;
+}
+
+// TPIXEL: 24 bit true color is sent as 3 bytes r,g,b, anything else as is.
+static int vnc_connection_tight_pixel_size(VncConnection *conn)
+{
+  VncPixelFormat *fmt = &conn->priv->fmt;
+
+  if (fmt->bits_per_pixel == 32 && fmt->depth == 24 &&
+      fmt->red_max == 255 && fmt->green_max == 255 && fmt->blue_max == 255)
+    return 3;
+  return fmt->bits_per_pixel / 8;
+}
+
+static void vnc_connection_tight_pixel_rgb(VncConnection *conn, unsigned char *src, unsigned char *rgb)
+{
+  if (vnc_connection_tight_pixel_size(conn) == 3)
+    memcpy(rgb, src, 3);
+  else
+    conn->priv->blt(&conn->priv->fmt, src, rgb, 1);
+}
+
+static int vnc_connection_read_compact_len(VncConnection *conn)
+{
+  int b = vnc_connection_read_u8(conn);
+  int len = b & 0x7f;
+
+  if (b & 0x80)
+    {
+      b = vnc_connection_read_u8(conn);
+      len |= (b & 0x7f) << 7;
+      if (b & 0x80)
+        len |= vnc_connection_read_u8(conn) << 14;
+    }
+  return len;
+}
+
+// priv->tight_buf of at least need bytes; without it we cannot stay in sync.
+static int vnc_connection_tight_buf(VncConnection *conn, int need)
+{
+  VncConnectionPrivate *priv = conn->priv;
+
+  if (vnc_buffer_reserve(&priv->tight_buf, &priv->tight_buf_size, need))
+    return TRUE;
+  fprintf(stderr, "Tight: no memory for %d bytes\n", need);
+  priv->has_error = TRUE;
+  return FALSE;
+}
+
+// read len bytes of rectangle data, inflated through stream id unless shorter than 12 bytes.
+static int vnc_connection_tight_read(VncConnection *conn, int id, unsigned char *out, int len)
+{
+  VncConnectionPrivate *priv = conn->priv;
+  z_stream *strm = &priv->streams[id + 1];
+  int clen, r;
+
+  if (len < 12)
+    return vnc_connection_read(conn, (char *)out, len) == len;
+
+  clen = vnc_connection_read_compact_len(conn);
+  if (!vnc_buffer_reserve(&priv->tight_in, &priv->tight_in_size, clen) ||
+      vnc_connection_read(conn, (char *)priv->tight_in, clen) != clen)
+    {
+      priv->has_error = TRUE;
+      return FALSE;
+    }
+  strm->next_in = priv->tight_in;
+  strm->avail_in = clen;
+  strm->next_out = out;
+  strm->avail_out = len;
+  while (strm->avail_out > 0)
+    {
+      r = inflate(strm, Z_SYNC_FLUSH);
+      if (r == Z_BUF_ERROR || (r != Z_OK && r != Z_STREAM_END))
+        break;
+    }
+  if (strm->avail_out > 0)
+    {
+      fprintf(stderr, "Tight: zlib stream %d inflated %d of %d bytes\n", id, len - strm->avail_out, len);
+      priv->has_error = TRUE;
+      return FALSE;
+    }
+  return TRUE;
+}
+
+// store one row of TPIXELs.
+static void vnc_connection_tight_row(VncConnection *conn, unsigned char *src, int x, int y, int w)
+{
+  VncConnectionPrivate *priv = conn->priv;
+  unsigned char *rgb = priv->rgb + 3 * (y * priv->width + x);
+  int tp = vnc_connection_tight_pixel_size(conn);
+
+  if (tp == 3)
+    {
+      memcpy(rgb, src, 3 * w);
+      return;
+    }
+  while (w-- > 0)
+    {
+      vnc_connection_tight_pixel_rgb(conn, src, rgb);
+      src += tp;
+      rgb += 3;
+    }
+}
+
+static void vnc_connection_tight_update(VncConnection *conn,
+                                        u_int16_t x, u_int16_t y,
+                                        u_int16_t width, u_int16_t height)
+{
+  VncConnectionPrivate *priv = conn->priv;
+  int tp = vnc_connection_tight_pixel_size(conn);
+  u_int8_t ccontrol = vnc_connection_read_u8(conn);
+  unsigned char *buf;
+  int i, j;
+
+  for (i = 0; i < 4; i++)
+    if (ccontrol & (1 << i))
+      inflateReset(&priv->streams[i + 1]);
+  ccontrol >>= 4;
+
+  if (ccontrol == 8)
+    {
+      // fill
+      unsigned char pix[4], rgb[3];
+
+      vnc_connection_read(conn, (char *)pix, tp);
+      vnc_connection_tight_pixel_rgb(conn, pix, rgb);
+      for (j = 0; j < height; j++)
+        {
+          unsigned char *p = priv->rgb + 3 * ((y + j) * priv->width + x);
+          for (i = 0; i < width; i++, p += 3)
+            memcpy(p, rgb, 3);
+        }
+      return;
+    }
+
+  if (ccontrol == 9)
+    {
+      // jpeg: skip it, the area keeps its old content.
+      int len = vnc_connection_read_compact_len(conn);
+
+      if (!priv->tight_jpeg_seen++)
+        fprintf(stderr, "Tight: JPEG rectangles are not supported, unset VNC_TINY_QUALITY\n");
+      if (!vnc_buffer_reserve(&priv->tight_in, &priv->tight_in_size, len) ||
+          vnc_connection_read(conn, (char *)priv->tight_in, len) != len)
+        priv->has_error = TRUE;	// the rest of the stream would be garbage
+      return;
+    }
 
+  if (ccontrol > 9)
+    {
+      fprintf(stderr, "Tight: bad compression control %d\n", ccontrol);
+      priv->has_error = TRUE;
+      return;
+    }
+
+  int id = ccontrol & 3;
+  int filter = (ccontrol & 4) ? vnc_connection_read_u8(conn) : 0;
+
+  switch (filter)
+    {
+    case 0:	// copy
+      if (!vnc_connection_tight_buf(conn, tp * width * height) ||
+          !vnc_connection_tight_read(conn, id, priv->tight_buf, tp * width * height))
+        break;
+      for (j = 0, buf = priv->tight_buf; j < height; j++, buf += tp * width)
+        vnc_connection_tight_row(conn, buf, x, y + j, width);
+      break;
+
+    case 1:	// palette
+      {
+        int n_colors = vnc_connection_read_u8(conn) + 1;
+        int row_bytes = (n_colors <= 2) ? (width + 7) / 8 : width;	// 1 bit per pixel, also for 1 color
+        unsigned char palette[256][4], pal_rgb[256][3];
+
+        for (i = 0; i < n_colors; i++)
+          {
+            vnc_connection_read(conn, (char *)palette[i], tp);
+            vnc_connection_tight_pixel_rgb(conn, palette[i], pal_rgb[i]);
+          }
+        if (!vnc_connection_tight_buf(conn, row_bytes * height) ||
+            !vnc_connection_tight_read(conn, id, priv->tight_buf, row_bytes * height))
+          break;
+        for (j = 0, buf = priv->tight_buf; j < height; j++, buf += row_bytes)
+          {
+            unsigned char *p = priv->rgb + 3 * ((y + j) * priv->width + x);
+            for (i = 0; i < width; i++, p += 3)
+              {
+                int c = (n_colors <= 2) ? (buf[i >> 3] >> (7 - (i & 7))) & 1 : buf[i];
+                if (c >= n_colors) c = 0;
+                memcpy(p, pal_rgb[c], 3);
+              }
+          }
+      }
+      break;
+
+    case 2:	// gradient
+      if (tp != 3)
+        {
+          fprintf(stderr, "Tight: gradient filter needs 24 bit true color\n");
+          priv->has_error = TRUE;
+          break;
+        }
+      if (!vnc_connection_tight_buf(conn, 3 * width * height) ||
+          !vnc_connection_tight_read(conn, id, priv->tight_buf, 3 * width * height))
+        break;
+      for (j = 0, buf = priv->tight_buf; j < height; j++, buf += 3 * width)
+        {
+          unsigned char *up = buf - 3 * width;	// previous row, already decoded
+          for (i = 0; i < 3 * width; i++)
+            {
+              int left = (i >= 3) ? buf[i-3] : 0;
+              int above = j ? up[i] : 0;
+              int corner = (j && i >= 3) ? up[i-3] : 0;
+              int pred = left + above - corner;
+              if (pred < 0) pred = 0;
+              if (pred > 255) pred = 255;
+              buf[i] = (unsigned char)(pred + buf[i]);
+            }
+          vnc_connection_tight_row(conn, buf, x, y + j, width);
+        }
+      break;
+
+    default:
+      fprintf(stderr, "Tight: unknown filter %d\n", filter);
+      priv->has_error = TRUE;
+      break;
+    }
+}
+#endif
 
 
-static int vnc_connection_framebuffer_update(VncConnection *conn, u_int16_t etype,
+static int vnc_connection_framebuffer_update(VncConnection *conn, int32_t etype,
                                                   u_int16_t x, u_int16_t y,
                                                   u_int16_t width, u_int16_t height)
 {
@@ -707,10 +1848,19 @@ static int vnc_connection_framebuffer_update(VncConnection *conn, u_int16_t etyp
     if (vnc_connection_has_error(conn))
         return !vnc_connection_has_error(conn);
 
+    long long bytes = priv->stats.bytes;
+
+#ifdef HAVE_PTHREAD
+    vnc_decode_order(conn, etype, x, y, width, height);
+#endif
     switch (etype) {
     case VNC_CONNECTION_ENCODING_RAW:
         if (!vnc_connection_validate_boundary(conn, x, y, width, height))
             break;
+#ifdef HAVE_PTHREAD
+        if (vnc_decode_raw(conn, x, y, width, height))
+            break;		// vnc_decode_join() updates the view
+#endif
         vnc_connection_raw_update(conn, x, y, width, height);
         vnc_connection_update(conn, x, y, width, height);
         break;
@@ -720,6 +1870,31 @@ static int vnc_connection_framebuffer_update(VncConnection *conn, u_int16_t etyp
         vnc_connection_copyrect_update(conn, x, y, width, height);
         vnc_connection_update(conn, x, y, width, height);
         break;
+#ifdef HAVE_ZLIB
+    case VNC_CONNECTION_ENCODING_TIGHT:
+        if (!vnc_connection_validate_boundary(conn, x, y, width, height))
+            break;
+        vnc_connection_tight_update(conn, x, y, width, height);
+        vnc_connection_update(conn, x, y, width, height);
+        break;
+#endif
+    case VNC_CONNECTION_ENCODING_LAST_RECT:
+        priv->last_rect = TRUE;
+        break;
+    case VNC_CONNECTION_ENCODING_DESKTOP_RESIZE:
+        vnc_connection_resize(conn, width, height);
+        break;
+    case VNC_CONNECTION_ENCODING_EXTENDED_DESKTOP_RESIZE: {
+        // x is the reason, y the status, followed by the screen layout we ignore.
+        char pad[16];
+        int n_screens = vnc_connection_read_u8(conn);
+
+        vnc_connection_read(conn, pad, 3);
+        while (n_screens-- > 0)
+          vnc_connection_read(conn, pad, 16);
+        if (y == 0)
+          vnc_connection_resize(conn, width, height);
+    }   break;
 #if 0
     case VNC_CONNECTION_ENCODING_RRE:
         if (!vnc_connection_validate_boundary(conn, x, y, width, height))
@@ -739,12 +1914,6 @@ static int vnc_connection_framebuffer_update(VncConnection *conn, u_int16_t etyp
         vnc_connection_zrle_update(conn, x, y, width, height);
         vnc_connection_update(conn, x, y, width, height);
         break;
-    case VNC_CONNECTION_ENCODING_TIGHT:
-        if (!vnc_connection_validate_boundary(conn, x, y, width, height))
-            break;
-        vnc_connection_tight_update(conn, x, y, width, height);
-        vnc_connection_update(conn, x, y, width, height);
-        break;
 #endif
     default:
         fprintf(stderr, "Unknown VNC_CONNECTION_ENCODING_ type: %d\n", etype);
@@ -752,6 +1921,12 @@ static int vnc_connection_framebuffer_update(VncConnection *conn, u_int16_t etyp
         break;
     }
 
+    if (etype >= 0 && etype < 32)
+      {
+        priv->stats.enc_bytes[etype] += priv->stats.bytes - bytes;
+        priv->stats.enc_rects[etype]++;
+      }
+
     return !vnc_connection_has_error(conn);
 }
 
@@ -797,82 +1972,588 @@ int vnc_connection_set_encodings(VncConnection *conn, int n_encoding, u_int32_t
     return !vnc_connection_has_error(conn);
 }
 
-static int vnc_connection_server_message(VncConnection *conn)
+/*
+ * VNC_TINY_ENCODINGS="tight,raw" sets the preference order,
+ * VNC_TINY_COMPRESS=0..9 the tight zlib level, VNC_TINY_QUALITY=0..9
+ * allows JPEG (which we cannot decode, so better leave it unset).
+ */
+static int vnc_connection_encodings(char *list, u_int32_t *encodings)
 {
-  int n;
-  fd_set rfds;
-  struct timeval tval;
+  int n = 0;
+
+#ifdef HAVE_ZLIB
+  if (!list) list = "tight,raw";
+#else
+  if (!list) list = "raw";
+#endif
+#ifdef HAVE_ZLIB
+  if (strstr(list, "tight"))
+    {
+      encodings[n++] = VNC_CONNECTION_ENCODING_TIGHT;
+      if (getenv("VNC_TINY_COMPRESS"))
+        encodings[n++] = VNC_CONNECTION_ENCODING_COMPRESS_LEVEL0 + atoi(getenv("VNC_TINY_COMPRESS"));
+      else
+        encodings[n++] = VNC_CONNECTION_ENCODING_COMPRESS_LEVEL0 + 9;	// bandwidth is more precious than server cpu
+      if (getenv("VNC_TINY_QUALITY"))
+        encodings[n++] = VNC_CONNECTION_ENCODING_TIGHT_JPEG0 + atoi(getenv("VNC_TINY_QUALITY"));
+    }
+#endif
+  if (strstr(list, "copyrect"))
+    encodings[n++] = VNC_CONNECTION_ENCODING_COPY_RECT;
+  if (strstr(list, "raw") || !n)
+    encodings[n++] = VNC_CONNECTION_ENCODING_RAW;
+
+  // pseudo encodings, VNC_TINY_CONTINUOUS=0 falls back to polling.
+  encodings[n++] = VNC_CONNECTION_ENCODING_LAST_RECT;
+  encodings[n++] = VNC_CONNECTION_ENCODING_DESKTOP_RESIZE;
+  encodings[n++] = VNC_CONNECTION_ENCODING_EXTENDED_DESKTOP_RESIZE;
+  if (!getenv("VNC_TINY_CONTINUOUS") || atoi(getenv("VNC_TINY_CONTINUOUS")))
+    {
+      encodings[n++] = VNC_CONNECTION_ENCODING_CONTINUOUS_UPDATES;
+      encodings[n++] = VNC_CONNECTION_ENCODING_FENCE;
+    }
+  return n;
+}
 
+// bytes per update, overall and per encoding.
+void vnc_connection_print_stats(VncConnection *conn, FILE *fp)
+{
+  VncConnectionPrivate *priv = conn->priv;
+  static char *names[32] = { [VNC_CONNECTION_ENCODING_RAW] = "raw", [VNC_CONNECTION_ENCODING_COPY_RECT] = "copyrect",
+                             [VNC_CONNECTION_ENCODING_TIGHT] = "tight", [VNC_CONNECTION_ENCODING_ZRLE] = "zrle" };
+  long updates = priv->stats.updates ? priv->stats.updates : 1;
+  int i;
+
+  fprintf(fp, "%s: %ld updates (%ld skipped), %lld bytes, %lld bytes/update", conn->host,
+          priv->stats.updates, priv->stats.skipped, priv->stats.bytes, priv->stats.bytes / updates);
+  if (priv->cost.bytes)
+    fprintf(fp, ", %lld us/kbyte", 1024 * priv->cost.usec / priv->cost.bytes);
+  if (priv->latency)
+    fprintf(fp, ", fence %lld ms", priv->latency / 1000);
+  for (i = 0; i < 32; i++)
+    if (priv->stats.enc_rects[i])
+      fprintf(fp, ", %s %ld rects %lld bytes/update", names[i] ? names[i] : "?",
+              priv->stats.enc_rects[i], priv->stats.enc_bytes[i] / updates);
+  fprintf(fp, "\n");
+}
+
+/*
+ * ContinuousUpdates: the server pushes changes of the region without
+ * waiting for a FramebufferUpdateRequest, saving one round trip per frame.
+ * The server answers enable=0 with EndOfContinuousUpdates.
+ */
+int vnc_connection_enable_continuous_updates(VncConnection *conn, int enable,
+                                             u_int16_t x, u_int16_t y,
+                                             u_int16_t width, u_int16_t height)
+{
+    vnc_connection_write_u8(conn, VNC_CONNECTION_CLIENT_MESSAGE_ENABLE_CONTINUOUS_UPDATES);
+    vnc_connection_write_u8(conn, enable ? 1 : 0);
+    vnc_connection_write_u16(conn, x);
+    vnc_connection_write_u16(conn, y);
+    vnc_connection_write_u16(conn, width);
+    vnc_connection_write_u16(conn, height);
+    vnc_connection_flush(conn);
+    conn->priv->cu_active = enable;
+
+    return !vnc_connection_has_error(conn);
+}
+
+int vnc_connection_fence(VncConnection *conn, u_int32_t flags, int len, char *data)
+{
+    char pad[3] = {0};
+    vnc_connection_write_u8(conn, VNC_CONNECTION_CLIENT_MESSAGE_FENCE);
+    vnc_connection_write(conn, pad, 3);
+    vnc_connection_write_u32(conn, flags);
+    vnc_connection_write_u8(conn, len);
+    vnc_connection_write(conn, data, len);
+    vnc_connection_flush(conn);
+    return !vnc_connection_has_error(conn);
+}
 
+/*
+ * Show what vnc_connection_throttle() held back, once nothing is left
+ * in the socket. The data it saw waiting may have been a Bell, a Fence or
+ * anything else but the next update.
+ */
+static void vnc_connection_catch_up(VncConnection *conn)
+{
   VncConnectionPrivate *priv = conn->priv;
-  if (vnc_connection_has_error(conn))
-    return FALSE;
+  int pending = 0;
 
-  FD_ZERO(&rfds);
-  FD_SET(conn->fd, &rfds);
-  n = conn->fd;
-  if (conn->fifo >= 0)
+  if (priv->dirty.w <= 0 || priv->dirty.h <= 0)
+    return;
+  ioctl(conn->fd, FIONREAD, &pending);
+  if (pending <= 0 && vnc_connection_expose(conn))
+    priv->last_expose = now_usec();
+}
+
+/*
+ * Flow control, called after each framebuffer update.
+ * When more data is already waiting in the socket, the update is decoded
+ * but not shown, so that the panel skips to the newest frame, as long as
+ * the panel does not stand still for more than half the latency budget.
+ * vnc_connection_catch_up() shows it when no update follows after all.
+ * When the backlog (estimated from our decode and output speed, or
+ * measured with a Fence round trip) exceeds VNC_TINY_LATENCY, continuous
+ * updates are paused for a while. Polling keeps at most one update in
+ * flight.
+ */
+static void vnc_connection_throttle(VncConnection *conn, long long t0, long long bytes)
+{
+  VncConnectionPrivate *priv = conn->priv;
+  long long budget = 1000LL * conn->latency_ms;
+  long long now = now_usec();
+  long long backlog = 0;
+  int pending = 0;
+
+  if (conn->replay)
     {
-      int nbytes = 0;
-      ioctl(conn->fifo, FIONREAD, &nbytes);
-      if (nbytes > 0)
-        {
-          if (conn->fifo > n) n = conn->fifo;
-          FD_SET(conn->fifo, &rfds);
-        }
+      // FIONREAD on a recording is the rest of the file, show every update.
+      vnc_connection_expose(conn);
+      return;
     }
-  tval.tv_sec = conn->msec_refresh / 1000;
-  tval.tv_usec = 1000 * (conn->msec_refresh - 1000 * tval.tv_sec);
-
-  n = select(n+1, &rfds, NULL, NULL, &tval);
-  if (n == 0)
+  ioctl(conn->fd, FIONREAD, &pending);
+  if (pending > 0 && now - priv->last_expose < budget / 2)
+    priv->stats.skipped++;
+  else if (vnc_connection_expose(conn))
+    priv->last_expose = now_usec();
+
+  now = now_usec();
+  priv->cost.usec += now - t0;
+  priv->cost.bytes += priv->stats.bytes - bytes;
+  if (priv->cost.bytes > (1 << 20))
     {
-      // timeout
-      // request incremental updates (or full updates if view.moved).
-      vnc_connection_framebuffer_update_request(conn, conn->view.moved ? 0 : 1, conn->view.x, conn->view.y, conn->view.w, conn->view.h);
-      conn->view.moved = 0;
-      return !vnc_connection_has_error(conn);
+      priv->cost.usec /= 2;
+      priv->cost.bytes /= 2;
     }
+  if (pending > 0 && priv->cost.bytes > 0)
+    backlog = pending * priv->cost.usec / priv->cost.bytes;
 
-  if (conn->fifo >= 0 && FD_ISSET(conn->fifo, &rfds))
+  if (!priv->cu_active)
+    return;
+  if (backlog > budget || priv->latency > budget)
     {
-      char buf[1024];
-      int x = conn->view.x;
-      int y = conn->view.y;
-
-      n = read(conn->fifo, buf, sizeof(buf)-1);
-      if (n < 0) return FALSE;
-      if (n > 0)
-        {
-          buf[n] = '\0';
-          n = sscanf(buf, "%d %d\n", &x, &y);
-	  if (n >= 1)
-            {
-	      // fprintf(stderr, "View (%d,%d) moved from (%d,%d) to (%d,%d) \n", conn->view.w,conn->view.h,
-	      //	conn->view.x,conn->view.y, x,y);
-	      if (x < 0) x = 0;
-              if (y < 0) y = 0;
-	      if (x+conn->view.w > conn->priv->width)  x = conn->priv->width  - conn->view.w;
-	      if (y+conn->view.h > conn->priv->height) y = conn->priv->height - conn->view.h;
-	      if (x != conn->view.x || y != conn->view.y) conn->view.moved = 1;
-              conn->view.x = x; 
-              conn->view.y = y; 
-            }
-        }
-      return TRUE;
+      fprintf(stderr, "%s: %lld ms behind, pausing continuous updates\n", conn->host,
+              (backlog > priv->latency ? backlog : priv->latency) / 1000);
+      vnc_connection_enable_continuous_updates(conn, FALSE, conn->view.x, conn->view.y, conn->view.w, conn->view.h);
+      priv->throttled_until = now + 10000000LL;
+      priv->latency = 0;
+      return;
+    }
+  if (priv->fence_supported && !priv->fence_sent && now >= priv->fence_next)
+    {
+      // the server answers behind everything it has queued for us.
+      priv->fence_sent = now;
+      priv->fence_next = now + 1000000LL;
+      vnc_connection_fence(conn, VNC_CONNECTION_FENCE_REQUEST | VNC_CONNECTION_FENCE_BLOCK_BEFORE,
+                           sizeof(now), (char *)&now);
     }
+}
 
-  int msg = vnc_connection_read_u8(conn);
-  switch (msg) {
-    case VNC_CONNECTION_SERVER_MESSAGE_FRAMEBUFFER_UPDATE: {
-        char pad[1];
-        u_int16_t n_rects;
-        int i;
-        // fprintf(stderr, "VNC_CONNECTION_SERVER_MESSAGE_FRAMEBUFFER_UPDATE\n");
+// while panning, cache at least what 250 ms of motion uncover.
+static int vnc_connection_margin(VncConnection *conn)
+{
+  VncPan *pan = &conn->pan;
+  int m = conn->margin;
+  int speed = 0;
 
-        vnc_connection_read(conn, pad, 1);
-        n_rects = vnc_connection_read_u16(conn);
-        for (i = 0; i < n_rects; i++) {
+  if (pan->n)
+    {
+      int dx = pan->px[pan->i] - pan->x0;
+      int dy = pan->py[pan->i] - pan->y0;
+      speed = 1000 * (abs(dx) > abs(dy) ? abs(dx) : abs(dy)) / (pan->ms[pan->i] ? pan->ms[pan->i] : 1);
+    }
+  else
+    speed = abs(pan->vx) > abs(pan->vy) ? abs(pan->vx) : abs(pan->vy);
+  if (speed && speed / 4 + 8 > m)
+    m = speed / 4 + 8;
+  return m;
+}
+
+// the view with margin m all around, and m more ahead of dx, dy.
+static void vnc_connection_track_rect(VncConnection *conn, int m, int dx, int dy, VncRect *next)
+{
+  VncRect desk = { 0, 0, conn->priv->width, conn->priv->height };
+  VncView *view = &conn->view;
+
+  next->x = view->x - m; next->y = view->y - m;
+  next->w = view->w + 2*m; next->h = view->h + 2*m;
+  if (dx > 0) next->w += m;
+  if (dx < 0) { next->x -= m; next->w += m; }
+  if (dy > 0) next->h += m;
+  if (dy < 0) { next->y -= m; next->h += m; }
+  vnc_rect_intersect(next, &desk, next);
+}
+
+/*
+ * Make sure the track covers the view with some margin, more of it
+ * ahead of the motion dx, dy. Only the parts not tracked before are
+ * requested in full, the rest stays on incremental updates.
+ */
+static void vnc_connection_track(VncConnection *conn, int dx, int dy)
+{
+  VncConnectionPrivate *priv = conn->priv;
+  VncView *view = &conn->view;
+  VncRect desk = { 0, 0, priv->width, priv->height };
+  VncRect old = conn->track;
+  VncRect want, next, keep;
+  int m = vnc_connection_margin(conn);
+  int full = view->moved;
+
+  want.x = view->x - m/2; want.y = view->y - m/2;
+  want.w = view->w + m;   want.h = view->h + m;
+  if (!vnc_rect_intersect(&want, &desk, &want))
+    return;
+  if (!full && vnc_rect_contains(&old, &want))
+    return;
+
+  vnc_connection_track_rect(conn, m, dx, dy, &next);
+  conn->track = next;
+  view->moved = 0;
+
+  if (priv->cu_active)
+    vnc_connection_enable_continuous_updates(conn, TRUE, next.x, next.y, next.w, next.h);
+  if (full || !vnc_rect_intersect(&old, &next, &keep))
+    {
+      vnc_connection_framebuffer_update_request(conn, 0, next.x, next.y, next.w, next.h);
+      return;
+    }
+  // up to four strips around what we keep.
+  if (keep.y > next.y)
+    vnc_connection_framebuffer_update_request(conn, 0, next.x, next.y, next.w, keep.y - next.y);
+  if (keep.y + keep.h < next.y + next.h)
+    vnc_connection_framebuffer_update_request(conn, 0, next.x, keep.y + keep.h, next.w, next.y + next.h - keep.y - keep.h);
+  if (keep.x > next.x)
+    vnc_connection_framebuffer_update_request(conn, 0, next.x, keep.y, keep.x - next.x, keep.h);
+  if (keep.x + keep.w < next.x + next.w)
+    vnc_connection_framebuffer_update_request(conn, 0, keep.x + keep.w, keep.y, next.x + next.w - keep.x - keep.w, keep.h);
+}
+
+/*
+ * Move or resize the view. What is inside the track is shown right away
+ * from our copy of the framebuffer, the server only hears about it when
+ * the view gets close to the edge of the track.
+ */
+void vnc_connection_move_view(VncConnection *conn, int x, int y, int w, int h)
+{
+  VncView *view = &conn->view;
+  VncView old = *view;
+  VncRect r;
+
+  view->x = x; view->y = y;
+  view->w = w; view->h = h;
+  vnc_connection_clamp_view(conn);
+  if (view->x == old.x && view->y == old.y && view->w == old.w && view->h == old.h)
+    return;
+  if (vnc_connection_has_error(conn) || !conn->priv->width)
+    return;		// vnc_connection_start() takes it from here
+
+  r.x = view->x; r.y = view->y; r.w = view->w; r.h = view->h;
+  if (vnc_rect_intersect(&conn->track, &r, &r))
+    vnc_connection_redraw(conn);
+  vnc_connection_track(conn, view->x - old.x, view->y - old.y);
+}
+
+// vncdisplay.c:on_initialized()
+int vnc_connection_start(VncConnection *conn, int incremental)
+{
+  u_int32_t encodings[16];
+  VncRect *t = &conn->track;
+
+  vnc_connection_set_encodings(conn, vnc_connection_encodings(conn->encodings, encodings), encodings);
+  conn->next_refresh = now_usec() + 1000LL * conn->msec_refresh;
+  if (!incremental)
+    {
+      // non-incremental to begin with, the track is requested in full.
+      memset(t, 0, sizeof(*t));
+      conn->view.moved = 1;
+      vnc_connection_track(conn, 0, 0);
+      return !vnc_connection_has_error(conn);
+    }
+  // we still hold the framebuffer, only ask for what changed since.
+  vnc_connection_track_rect(conn, vnc_connection_margin(conn), 0, 0, t);
+  conn->view.moved = 0;
+  return vnc_connection_framebuffer_update_request(conn, 1, t->x, t->y, t->w, t->h);
+}
+
+#define VNC_BACKOFF_MIN_MS	250
+#define VNC_BACKOFF_MAX_MS	30000
+
+#define VNC_CONNECT_TIMEOUT_MS	5000
+
+// handshake on the connected conn->fd, then pick up where we were.
+static int vnc_connection_resume(VncConnection *conn)
+{
+  VncConnectionPrivate *priv = conn->priv;
+
+  priv->has_error = FALSE;
+  memset(&priv->dirty, 0, sizeof(priv->dirty));
+  if (!vnc_connection_initialize(conn))
+    {
+      close(conn->fd);
+      conn->fd = -1;
+      priv->has_error = TRUE;
+      return FALSE;
+    }
+  vnc_connection_clamp_view(conn);
+  conn->view.moved = 0;
+
+  if (priv->fb_reused && conn->offline_frame)
+    {
+      // the fallback animation was shown, put the last frame back.
+      vnc_connection_update(conn, conn->view.x, conn->view.y, conn->view.w, conn->view.h);
+      vnc_connection_expose(conn);
+    }
+  conn->offline_frame = 0;
+  return vnc_connection_start(conn, priv->fb_reused);
+}
+
+static int vnc_connection_reconnect(VncConnection *conn)
+{
+  conn->fd = vnc_connection_open(conn->host, conn->port, &conn->addr, &conn->addrlen);
+  if (conn->fd < 0)
+    return FALSE;
+  return vnc_connection_resume(conn);
+}
+
+static int vnc_connection_connect_failed(VncConnection *conn)
+{
+  close(conn->fd);
+  conn->fd = -1;
+  conn->connecting = 0;
+  conn->addrlen = 0;	// resolve again next time
+  return FALSE;
+}
+
+static int vnc_fd_ready(int fd, int write)
+{
+  struct timeval tval = { 0, 0 };
+  fd_set fds;
+
+  FD_ZERO(&fds);
+  FD_SET(fd, &fds);
+  return select(fd+1, write ? NULL : &fds, write ? &fds : NULL, NULL, &tval) > 0;
+}
+
+/*
+ * The same as vnc_connection_reconnect() for conn->async, in steps that
+ * never wait: a non-blocking connect() to the cached (or first resolved)
+ * address, then the handshake once the server version is there.
+ * Returns TRUE when online, FALSE on failure, -1 while still connecting;
+ * vnc_connection_connecting() tells what to select() on meanwhile.
+ */
+static int vnc_connection_reconnect_async(VncConnection *conn, long long now)
+{
+  struct timeval tval = { 2, 0 };	// bounds each handshake read
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (!conn->connecting)
+    {
+      if (!conn->addrlen)
+        {
+          struct addrinfo hints, *result;
+          int s;
+
+          memset(&hints, 0, sizeof(hints));
+          hints.ai_family = AF_INET;
+          hints.ai_socktype = SOCK_STREAM;
+          s = getaddrinfo(conn->host, conn->port ? conn->port : "5900", &hints, &result);
+          if (s != 0)
+            {
+              fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+              return FALSE;
+            }
+          if (result->ai_addrlen <= sizeof(conn->addr))
+            {
+              memcpy(&conn->addr, result->ai_addr, result->ai_addrlen);
+              conn->addrlen = result->ai_addrlen;
+            }
+          freeaddrinfo(result);
+          if (!conn->addrlen)
+            return FALSE;
+        }
+      if ((conn->fd = socket(conn->addr.ss_family, SOCK_STREAM, 0)) < 0)
+        return FALSE;
+      fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+      if (connect(conn->fd, (struct sockaddr *)&conn->addr, conn->addrlen) < 0 && errno != EINPROGRESS)
+        return vnc_connection_connect_failed(conn);
+      conn->connecting = 1;
+      conn->next_retry = now + 1000LL * VNC_CONNECT_TIMEOUT_MS;
+    }
+  if (now >= conn->next_retry)
+    {
+      fprintf(stderr, "Could not connect to %s, timeout\n", conn->host);
+      return vnc_connection_connect_failed(conn);
+    }
+  if (conn->connecting == 1)
+    {
+      if (!vnc_fd_ready(conn->fd, TRUE))
+        return -1;
+      if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+        {
+          fprintf(stderr, "Could not connect to %s: %s\n", conn->host, strerror(err ? err : errno));
+          return vnc_connection_connect_failed(conn);
+        }
+      fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) & ~O_NONBLOCK);
+      setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+      setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tval, sizeof(tval));
+      conn->connecting = 2;
+    }
+  // a server that accepts and then says nothing does not get to block us.
+  if (!vnc_fd_ready(conn->fd, FALSE))
+    return -1;
+  conn->connecting = 0;
+  return vnc_connection_resume(conn);
+}
+
+// the fd to select() on for writing (*write) or reading while connecting, or -1.
+int vnc_connection_connecting(VncConnection *conn, int *write)
+{
+  *write = conn->connecting == 1;
+  return conn->connecting ? conn->fd : -1;
+}
+
+/*
+ * Call this instead of reading while vnc_connection_has_error().
+ * The panel keeps the last frame, or plays the offline_rgb animation,
+ * while we reconnect with exponential backoff. A reconnect to a desktop
+ * of the same size reuses the framebuffer and starts with an incremental
+ * update request.
+ * Returns 0 when online again, otherwise the usec until the next call.
+ */
+long long vnc_connection_offline(VncConnection *conn)
+{
+  long long now = now_usec();
+  long long wait;
+  int r;
+
+  if (conn->fd >= 0 && !conn->connecting)
+    {
+      fprintf(stderr, "Connection to %s lost\n", conn->host);
+      if (conn->record >= 0)
+        {
+          // a replay cannot follow a second handshake.
+          fprintf(stderr, "VNC_TINY_RECORD: recording stopped\n");
+          close(conn->record);
+          conn->record = -1;
+        }
+      close(conn->fd);
+      conn->fd = -1;
+      conn->backoff_ms = VNC_BACKOFF_MIN_MS;
+      conn->next_retry = now + 1000LL * conn->backoff_ms;
+    }
+
+  if (conn->connecting || now >= conn->next_retry)
+    {
+      r = conn->async ? vnc_connection_reconnect_async(conn, now) : vnc_connection_reconnect(conn);
+      if (r > 0)
+        {
+          conn->backoff_ms = 0;
+          return 0;
+        }
+      if (r == 0)
+        {
+          conn->backoff_ms *= 2;
+          if (conn->backoff_ms < VNC_BACKOFF_MIN_MS) conn->backoff_ms = VNC_BACKOFF_MIN_MS;
+          if (conn->backoff_ms > VNC_BACKOFF_MAX_MS) conn->backoff_ms = VNC_BACKOFF_MAX_MS;
+          now = now_usec();
+          conn->next_retry = now + 1000LL * conn->backoff_ms;
+          fprintf(stderr, "Retrying %s in %d ms\n", conn->host, conn->backoff_ms);
+        }
+    }
+  wait = conn->next_retry - now;	// while connecting, the connect() deadline
+
+  if (conn->offline_n && conn->expose_cb)
+    {
+      if (now >= conn->next_offline_frame)
+        {
+          VncRect all = { 0, 0, conn->panel.w, conn->panel.h };
+          int size = 3 * conn->panel.w * conn->panel.h;
+          unsigned char *rgb = conn->offline_rgb + size * (conn->offline_frame++ % conn->offline_n);
+
+          conn->expose_cb(&conn->panel, rgb, 3 * conn->panel.w, &all, conn->expose_cb_data);
+          conn->next_offline_frame = now + 1000LL * conn->msec_refresh;
+        }
+      if (conn->next_offline_frame - now < wait)
+        wait = conn->next_offline_frame - now;
+    }
+  return wait > 0 ? wait : 1;
+}
+
+// load all panel sized *.rgb files of a directory as fallback animation.
+int vnc_connection_set_offline(VncConnection *conn, char *dir)
+{
+  char pattern[1024];
+  glob_t g;
+  int size = 3 * conn->panel.w * conn->panel.h;
+  int i;
+
+  snprintf(pattern, sizeof(pattern), "%s/*.rgb", dir);
+  if (glob(pattern, 0, NULL, &g) != 0)
+    return FALSE;
+  conn->offline_rgb = (unsigned char *)calloc(g.gl_pathc, size);
+  conn->offline_n = 0;
+  for (i = 0; i < g.gl_pathc; i++)
+    if (read_rgb_file(conn->panel.w, conn->panel.h, g.gl_pathv[i], conn->offline_rgb + size * conn->offline_n))
+      conn->offline_n++;
+  globfree(&g);
+  return conn->offline_n > 0;
+}
+
+/*
+ * request incremental updates of the track (or full updates if view.moved).
+ * With continuous updates there is nothing to poll. When
+ * vnc_connection_throttle() paused them, they are resumed here.
+ */
+static int vnc_connection_refresh(VncConnection *conn)
+{
+  VncView *view = &conn->view;
+  VncConnectionPrivate *priv = conn->priv;
+  VncRect *t = &conn->track;
+
+  if (view->moved)
+    {
+      // also sets the continuous updates region.
+      vnc_connection_track(conn, 0, 0);
+      return !vnc_connection_has_error(conn);
+    }
+  if (priv->cu_active)
+    return !vnc_connection_has_error(conn);
+  if (priv->cu_supported && priv->throttled_until && now_usec() > priv->throttled_until)
+    {
+      // try again after a pause, with a full update to start from.
+      priv->throttled_until = 0;
+      priv->fence_sent = 0;
+      priv->latency = 0;
+      vnc_connection_enable_continuous_updates(conn, TRUE, t->x, t->y, t->w, t->h);
+      return vnc_connection_framebuffer_update_request(conn, 0, t->x, t->y, t->w, t->h);
+    }
+  return vnc_connection_framebuffer_update_request(conn, 1, t->x, t->y, t->w, t->h);
+}
+
+// read and handle one message, the socket must be readable.
+static int vnc_connection_dispatch(VncConnection *conn)
+{
+  VncConnectionPrivate *priv = conn->priv;
+  if (vnc_connection_has_error(conn))
+    return FALSE;
+
+  int msg = vnc_connection_read_u8(conn);
+  switch (msg) {
+    case VNC_CONNECTION_SERVER_MESSAGE_FRAMEBUFFER_UPDATE: {
+        char pad[1];
+        u_int16_t n_rects;
+        int i;
+        // fprintf(stderr, "VNC_CONNECTION_SERVER_MESSAGE_FRAMEBUFFER_UPDATE\n");
+
+        long long t0 = now_usec();
+        long long bytes = priv->stats.bytes;
+
+        vnc_connection_read(conn, pad, 1);
+        n_rects = vnc_connection_read_u16(conn);
+        priv->last_rect = FALSE;
+        for (i = 0; i < n_rects && !priv->last_rect; i++) {
             u_int16_t x, y, w, h;
             int32_t etype;
 
@@ -885,6 +2566,54 @@ static int vnc_connection_server_message(VncConnection *conn)
             if (!vnc_connection_framebuffer_update(conn, etype, x, y, w, h))
                 break;
         }
+#ifdef HAVE_PTHREAD
+        vnc_decode_join(conn);
+#endif
+        // one expose per update, not per rectangle, and none while behind.
+        priv->stats.updates++;
+        vnc_connection_throttle(conn, t0, bytes);
+        if (conn->stats_every && !(priv->stats.updates % conn->stats_every))
+          vnc_connection_print_stats(conn, stderr);
+        if (conn->view.moved)
+          vnc_connection_refresh(conn);	// resized, don't wait for a poll
+    }   break;
+
+    case VNC_CONNECTION_SERVER_MESSAGE_BELL:
+        break;
+
+    case VNC_CONNECTION_SERVER_MESSAGE_END_OF_CONTINUOUS_UPDATES:
+        // first one says the server can do it, later ones confirm a disable.
+        if (!priv->cu_supported)
+          {
+            priv->cu_supported = TRUE;
+            vnc_connection_enable_continuous_updates(conn, TRUE, conn->track.x, conn->track.y, conn->track.w, conn->track.h);
+          }
+        else
+          priv->cu_active = FALSE;
+        break;
+
+    case VNC_CONNECTION_SERVER_MESSAGE_FENCE: {
+        char pad[3];
+        char data[64];
+        u_int32_t flags;
+        int len;
+
+        vnc_connection_read(conn, pad, 3);
+        flags = vnc_connection_read_u32(conn);
+        len = vnc_connection_read_u8(conn);
+        if (len > 64) { fprintf(stderr, "Closing: fence > 64 bytes\n"); priv->has_error = TRUE; break; }
+        vnc_connection_read(conn, data, len);
+        if (flags & VNC_CONNECTION_FENCE_REQUEST)
+          {
+            // everything before it is already handled, we are synchronous.
+            priv->fence_supported = TRUE;
+            vnc_connection_fence(conn, flags & (VNC_CONNECTION_FENCE_BLOCK_BEFORE | VNC_CONNECTION_FENCE_BLOCK_AFTER), len, data);
+          }
+        else if (priv->fence_sent && len == sizeof(priv->fence_sent) && !memcmp(data, &priv->fence_sent, len))
+          {
+            priv->latency = now_usec() - priv->fence_sent;
+            priv->fence_sent = 0;
+          }
     }   break;
 
     case VNC_CONNECTION_SERVER_MESSAGE_SERVER_CUT_TEXT: {
@@ -894,7 +2623,7 @@ static int vnc_connection_server_message(VncConnection *conn)
 
         vnc_connection_read(conn, pad, 3);
         n_text = vnc_connection_read_u32(conn);
-	if (n_text > (32 << 20)) { fprintf(stderr, "Closing: cutText > allowed\n"); exit(9); }
+	if (n_text > (32 << 20)) { fprintf(stderr, "Closing: cutText > allowed\n"); priv->has_error = TRUE; break; }
 
         data = (char *)calloc(sizeof(char), n_text + 1);
         vnc_connection_read(conn, data, n_text);
@@ -910,141 +2639,1788 @@ static int vnc_connection_server_message(VncConnection *conn)
         break;
   } // switch(msg)
 
+  if (msg != VNC_CONNECTION_SERVER_MESSAGE_FRAMEBUFFER_UPDATE)
+    vnc_connection_catch_up(conn);
   return !vnc_connection_has_error(conn);
 }
 
-int draw_ascii_art(VncView *view, unsigned char *rgb, int stride, void *data)
+static int vnc_ctl_fdset(struct VncCtl *ctl, fd_set *rfds, int maxfd);
+static int vnc_ctl_serve(struct VncCtl *ctl, fd_set *rfds);
+
+static int vnc_connection_panning(VncConnection *conn)
 {
-  rgb += view->x * 3;
-  rgb += view->y * stride;
-  draw_ttyc8(32,32,rgb,stride);
-  return TRUE;
+  return conn->pan.n || conn->pan.vx || conn->pan.vy;
 }
 
-struct draw_ledpanel_data
+// smoothstep, t and the result in 16.16
+static long long vnc_pan_ease(long long t)
 {
-  int fd;
-  unsigned char *lut;
-};
+  return (t * t >> 16) * (3*65536 - 2*t) >> 16;
+}
 
-#ifdef USE_GAMMA_LUT
-// rg, gg, bg, are gamma values in the range of [-16..0..16], -16 is brightest, 0 is linear, 16 is darkest.
-unsigned char *mkgamma_lut(int rg, int gg, int bg)
+// position the view for the time now.
+static void vnc_connection_pan_step(VncConnection *conn, long long now)
 {
-  unsigned char *lut = (unsigned char *)calloc(3, 256);
-
-  unsigned int i;
-
-#define L_POW4(i)    ((i)*(i)*(i)/255*(i)/(255*255))
-#define L_POW3(i)    ((i)*(i)*(i)/        (255*255))
-#define L_POW2(i)        ((i)*(i)/        (255))
-
-#define L_RANGE(o,i)	(32-(o)+(i)*7/8)
-
-  if (rg < 0)
-    for (i = 0; i < 255; i++) lut[i+0*256] = L_RANGE(8, 255-((16+rg)*(255-i)-rg*L_POW2(255-i))/16);
-  else
-    for (i = 0; i < 255; i++) lut[i+0*256] = L_RANGE(8,     ((16-rg)*i      +rg*L_POW2(    i))/16);
+  VncPan *pan = &conn->pan;
+  VncView *view = &conn->view;
+  int x = view->x, y = view->y;
 
-  if (gg < 0)
-    for (i = 0; i < 255; i++) lut[i+1*256] = L_RANGE(8, 255-((16+gg)*(255-i)-gg*L_POW2(255-i))/16);
-  else
-    for (i = 0; i < 255; i++) lut[i+1*256] = L_RANGE(8,     ((16-gg)*i      +gg*L_POW2(    i))/16);
+  if (pan->n)
+    {
+      long long t = (now - pan->t0) / 1000;
 
-  if (bg < 0)
-    for (i = 0; i < 255; i++) lut[i+2*256] = L_RANGE(8, 255-((16+bg)*(255-i)-bg*L_POW2(255-i))/16);
-  else
-    for (i = 0; i < 255; i++) lut[i+2*256] = L_RANGE(8,     ((16-bg)*i      +bg*L_POW2(    i))/16);
+      while (t >= pan->ms[pan->i])
+        {
+          // segment done, on to the next waypoint.
+          pan->x0 = pan->px[pan->i];
+          pan->y0 = pan->py[pan->i];
+          pan->t0 += 1000LL * pan->ms[pan->i];
+          t -= pan->ms[pan->i];
+          if (++pan->i == pan->n)
+            {
+              pan->i = 0;
+              if (!pan->loop)
+                {
+                  pan->n = 0;
+                  break;
+                }
+            }
+        }
+      if (pan->n)
+        {
+          long long s = vnc_pan_ease(65536 * t / (pan->ms[pan->i] ? pan->ms[pan->i] : 1));
+          x = pan->x0 + ((pan->px[pan->i] - pan->x0) * s >> 16);
+          y = pan->y0 + ((pan->py[pan->i] - pan->y0) * s >> 16);
+        }
+      else
+        {
+          x = pan->x0;
+          y = pan->y0;
+        }
+    }
+  else if (pan->vx || pan->vy)
+    {
+      x = pan->x0 + pan->vx * (now - pan->t0) / 1000000;
+      y = pan->y0 + pan->vy * (now - pan->t0) / 1000000;
+    }
+  vnc_connection_move_view(conn, x, y, view->w, view->h);
+  if (pan->vx || pan->vy)
+    {
+      if (view->x != x || view->y != y)
+        pan->vx = pan->vy = 0;	// hit the edge of the desktop
+    }
 
-  return lut;
+  pan->next_frame += 1000000 / (pan->fps > 0 ? pan->fps : 30);
+  if (pan->next_frame < now)
+    pan->next_frame = now;	// we were late, don't catch up
 }
-#endif
 
-int draw_ledpanel(VncView *view, unsigned char *rgb, int stride, void *data)
+/*
+ * "X,Y[@MS] X,Y[@MS] ... [loop]" glides along waypoints, each segment
+ * taking MS milliseconds (default 1000). "stop" or "" stops panning.
+ */
+int vnc_connection_set_pan(VncConnection *conn, char *spec)
 {
-  // FIXME: need gamma curves here!
-  struct draw_ledpanel_data *d = (struct draw_ledpanel_data *)data;
-  static unsigned char led[32*32*3];
-  unsigned char *p = led;
-  int h = 32;
-
-  rgb += view->x * 3;
-  rgb += view->y * stride;
-
-#ifdef USE_GAMMA_LUT
-  // with only 7 values, all on the bright side, gamma correction is hard.
-  if (!d->lut) d->lut = mkgamma_lut(8,8,8);
-#endif
-  while (h-- > 0)
+  VncPan *pan = &conn->pan;
+  char *tok, *save;
+  int n = 0;
+
+  pan->n = 0;
+  pan->vx = pan->vy = 0;
+  pan->loop = FALSE;
+  for (tok = strtok_r(spec, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save))
     {
-#ifdef USE_GAMMA_LUT
-      int x;
-      for (x = 0; x < 3*32; x+=3)
-        {
-          p[x+0] = d->lut[rgb[x+0]+0*256];
-          p[x+1] = d->lut[rgb[x+1]+1*256];
-          p[x+2] = d->lut[rgb[x+2]+2*256];
-        }
-#else
-      memcpy(p, rgb, 3*32);
-#endif
-      rgb += stride;
-      p += 3*32;
+      int ms = 1000;
+      if (!strcmp(tok, "loop"))
+        pan->loop = TRUE;
+      else if (!strcmp(tok, "stop"))
+        continue;
+      else if (n < VNC_PAN_POINTS && sscanf(tok, "%d,%d@%d", &pan->px[n], &pan->py[n], &ms) >= 2)
+        pan->ms[n++] = ms > 0 ? ms : 1;
+      else
+        return FALSE;
     }
-  // lseek(d->fd, 0, 0);
-  write(d->fd, led, 3*32*32);
+  pan->x0 = conn->view.x;
+  pan->y0 = conn->view.y;
+  pan->i = 0;
+  pan->t0 = pan->next_frame = now_usec();
+  pan->n = n;
   return TRUE;
 }
 
+// constant velocity in px/s, 0 0 stops.
+void vnc_connection_set_velocity(VncConnection *conn, int vx, int vy)
+{
+  VncPan *pan = &conn->pan;
+
+  pan->n = 0;
+  pan->vx = vx;
+  pan->vy = vy;
+  pan->x0 = conn->view.x;
+  pan->y0 = conn->view.y;
+  pan->t0 = pan->next_frame = now_usec();
+}
 
-int main(int ac, char **av)
+static int vnc_connection_server_message(VncConnection *conn)
 {
-  if (!av[1])
-    {
-      fprintf(stderr,
-"vnc_tiny_view connects your Arietta ledpanel to a remote X-Server.\n\
-\n\
-Usage:\n\
-  # On the X-Server HOST run a VNC server e.g. like this:\n\
-  x11vnc -clip 640x480x0x0 -cursor none -loop\n\
-\n\
-  # On Arietta:\n\
-  VNC_TINY_CFG=/tmp/fifo %s HOST [5900] &\n\
-\n\
-  # To reposition the viewport:\n\
-  echo 100 100 > /tmp/fifo\n", av[0]);
-      exit(0);
-    }
+  int n;
+  fd_set rfds;
+  struct timeval tval;
+  long long now = now_usec();
+  long long wait;
 
-#if 1
-  VncConnection *conn = connect_vnc_server(av[1], av[2]);	// hostname [port]
-  if (!vnc_connection_initialize(conn)) exit(8);
-  conn->view.x = 0;
-  conn->view.y = 0;
-  conn->view.w = 32;
-  conn->view.h = 32;
+  if (vnc_connection_has_error(conn))
+    return FALSE;
 
-  struct draw_ledpanel_data draw_ledpanel_data;
-  draw_ledpanel_data.lut = NULL;
-  draw_ledpanel_data.fd = open("/sys/class/ledpanel/rgb_buffer", O_WRONLY);
-  if (getenv("VNC_TINY_STDOUT") || draw_ledpanel_data.fd < 0)
+  FD_ZERO(&rfds);
+  FD_SET(conn->fd, &rfds);
+  n = vnc_ctl_fdset(conn->ctl, &rfds, conn->fd);
+  wait = conn->next_refresh - now;
+  if (vnc_connection_panning(conn) && conn->pan.next_frame - now < wait)
+    wait = conn->pan.next_frame - now;
+  if (wait < 0) wait = 0;
+  tval.tv_sec = wait / 1000000;
+  tval.tv_usec = wait % 1000000;
+
+  n = select(n+1, &rfds, NULL, NULL, &tval);
+  if (n < 0)
+    return TRUE;	// EINTR
+  now = now_usec();
+  if (vnc_connection_panning(conn) && now >= conn->pan.next_frame)
+    vnc_connection_pan_step(conn, now);
+  if (n == 0)
     {
-      conn->expose_cb = draw_ascii_art;
+      // timeout, nothing heard for msec_refresh
+      vnc_connection_catch_up(conn);
+      if (now < conn->next_refresh)
+        return !vnc_connection_has_error(conn);
+      conn->next_refresh = now + 1000LL * conn->msec_refresh;
+      return vnc_connection_refresh(conn);
     }
-  else
+
+  if (vnc_ctl_serve(conn->ctl, &rfds))
     {
-      conn->expose_cb = draw_ledpanel;
-      conn->expose_cb_data = (void *)&draw_ledpanel_data;
+      // a busy server may never let the select() above time out.
+      if (conn->view.moved)
+        return vnc_connection_refresh(conn);
+      if (!FD_ISSET(conn->fd, &rfds))
+        return !vnc_connection_has_error(conn);
     }
 
-  // vncdisplay.c:on_initialized()
-  u_int32_t encodings[] = { VNC_CONNECTION_ENCODING_RAW };	// , VNC_CONNECTION_ENCODING_COPY_RECT };
-  vnc_connection_set_encodings(conn, 1, encodings);
-  // non-incremental to begin with.
-  vnc_connection_framebuffer_update_request(conn, 0, conn->view.x, conn->view.y, conn->view.w, conn->view.h);
+  conn->next_refresh = now + 1000LL * conn->msec_refresh;
+  return vnc_connection_dispatch(conn);
+}
 
-  while (vnc_connection_server_message(conn))
-    ;
+/*
+ * Console renderer for VNC_TINY_STDOUT.
+ * A frame is composed into one preallocated buffer and written at once.
+ * Only cells that differ from the previous frame are sent, with absolute
+ * cursor positioning, and color escapes are only emitted when the color
+ * changes from one cell to the next.
+ * VNC_TINY_STDOUT selects the mode: 1 (8 colors), 256, truecolor, ramp;
+ * add "half" for upper half block characters carrying two pixel rows per line.
+ */
+#define VNC_TTY_8C	0
+#define VNC_TTY_RAMP	1
+#define VNC_TTY_256	2
+#define VNC_TTY_TRUE	3
+
+typedef struct VncTty
+{
+  int fd;
+  int mode;
+  int half;		// two pixel rows per text line
+  int cols, rows;	// text cells
+  u_int32_t *fg;	// per cell colors of the previous frame
+  u_int32_t *bg;
+  int valid;		// fg/bg match what the terminal shows
+  char *buf;
+  int len;
+  int attr_valid;	// cur_fg/cur_bg are set on the terminal
+  u_int32_t cur_fg, cur_bg;
+  int cur_col, cur_row;	// cursor position, -1 if unknown
+} VncTty;
+
+void vnc_tty_init(VncTty *t, int fd, char *spec)
+{
+  memset(t, 0, sizeof(*t));
+  t->fd = fd;
+  t->mode = VNC_TTY_8C;
+  if (strstr(spec, "ramp")) t->mode = VNC_TTY_RAMP;
+  if (strstr(spec, "256"))  t->mode = VNC_TTY_256;
+  if (strstr(spec, "true") || strstr(spec, "24")) t->mode = VNC_TTY_TRUE;
+  if (strstr(spec, "half") && t->mode != VNC_TTY_RAMP) t->half = 1;
+}
+
+static int vnc_tty_resize(VncTty *t, int w, int h)
+{
+  int rows = t->half ? (h+1)/2 : h;
+
+  if (t->buf && t->cols == w && t->rows == rows)
+    return TRUE;
+  free(t->fg); free(t->bg); free(t->buf);
+  t->cols = w;
+  t->rows = rows;
+  t->fg = (u_int32_t *)calloc(w * rows, sizeof(u_int32_t));
+  t->bg = (u_int32_t *)calloc(w * rows, sizeof(u_int32_t));
+  // worst case per cell: cursor move, both colors in truecolor, two glyphs.
+  t->buf = (char *)malloc(w * rows * 64 + 64);
+  t->valid = FALSE;
+  return t->fg && t->bg && t->buf;
+}
+
+// color value as used in the escape sequence of the current mode.
+static u_int32_t vnc_tty_color(VncTty *t, unsigned char *p)
+{
+  int dim;
+
+  switch (t->mode)
+    {
+    case VNC_TTY_RAMP:
+      return (unsigned char)rgb_ramp_char(p[0], p[1], p[2]);
+    case VNC_TTY_256:
+      return 16 + 36*((p[0]*5+127)/255) + 6*((p[1]*5+127)/255) + (p[2]*5+127)/255;
+    case VNC_TTY_TRUE:
+      return (p[0] << 16) | (p[1] << 8) | p[2];
+    default:
+      return rgb_ansi8(p[0], p[1], p[2], &dim) | (dim << 8);
+    }
+}
+
+static void vnc_tty_color_seq(VncTty *t, int bg, u_int32_t c)
+{
+  char *o = t->buf + t->len;
+
+  if (t->mode == VNC_TTY_256)
+    o += sprintf(o, "\x1b[%d;5;%um", bg ? 48 : 38, c);
+  else if (t->mode == VNC_TTY_TRUE)
+    o += sprintf(o, "\x1b[%d;2;%u;%u;%um", bg ? 48 : 38, c >> 16, (c >> 8) & 0xff, c & 0xff);
+  else
+    o += sprintf(o, "\x1b[%um", (c & 0xff) + (bg ? 10 : 0));
+  t->len = o - t->buf;
+}
+
+static void vnc_tty_cell(VncTty *t, int col, int row, u_int32_t fg, u_int32_t bg)
+{
+  char *o;
+
+  if (t->cur_row != row || t->cur_col != col)
+    t->len += sprintf(t->buf + t->len, "\x1b[%d;%dH", row + 1, (t->half ? 1 : 2) * col + 1);
+
+  if (t->mode == VNC_TTY_RAMP)
+    {
+      t->buf[t->len++] = fg;
+      t->buf[t->len++] = fg;
+    }
+  else if (t->half)
+    {
+      // upper half block: foreground is the upper pixel, background the lower one.
+      if (!t->attr_valid || t->cur_fg != fg) vnc_tty_color_seq(t, 0, fg);
+      if (!t->attr_valid || t->cur_bg != bg) vnc_tty_color_seq(t, 1, bg);
+      o = t->buf + t->len;
+      *o++ = '\xe2'; *o++ = '\x96'; *o++ = '\x80';
+      t->len = o - t->buf;
+    }
+  else if (t->mode == VNC_TTY_8C)
+    {
+      if (!t->attr_valid || t->cur_fg != fg)
+        t->len += sprintf(t->buf + t->len, "\x1b[%u;1;%um", fg & 0xff, (fg & 0xff) + 10);
+      memcpy(t->buf + t->len, (fg >> 8) ? "  " : "@@", 2);
+      t->len += 2;
+      bg = fg;
+    }
+  else
+    {
+      if (!t->attr_valid || t->cur_bg != bg) vnc_tty_color_seq(t, 1, bg);
+      t->buf[t->len++] = ' ';
+      t->buf[t->len++] = ' ';
+      fg = t->cur_fg;
+    }
+  t->attr_valid = (t->mode != VNC_TTY_RAMP);
+  t->cur_fg = fg;
+  t->cur_bg = bg;
+  t->cur_row = row;
+  t->cur_col = col + 1;
+}
+
+int draw_ascii_art(VncView *view, unsigned char *rgb, int stride, VncRect *dirty, void *data)
+{
+  VncTty *t = (VncTty *)data;
+  VncRect d = *dirty;
+  int row, col, row0, row1;
+
+  if (!vnc_tty_resize(t, view->w, view->h))
+    return FALSE;
+  rgb += view->x * 3;
+  rgb += view->y * stride;
+
+  t->len = 0;
+  t->attr_valid = FALSE;
+  t->cur_row = t->cur_col = -1;
+  if (!t->valid)
+    {
+      t->len = sprintf(t->buf, "\x1b[H\x1b[2J");
+      d.x = d.y = 0;
+      d.w = view->w;
+      d.h = view->h;
+    }
+
+  row0 = t->half ? d.y / 2 : d.y;
+  row1 = t->half ? (d.y + d.h + 1) / 2 : d.y + d.h;
+  for (row = row0; row < row1; row++)
+    {
+      unsigned char *top = rgb + (t->half ? 2*row : row) * stride;
+      unsigned char *bot = (t->half && 2*row+1 < view->h) ? top + stride : top;
+
+      for (col = d.x; col < d.x + d.w; col++)
+        {
+          int i = row * t->cols + col;
+          u_int32_t fg = vnc_tty_color(t, top + 3*col);
+          u_int32_t bg = t->half ? vnc_tty_color(t, bot + 3*col) : fg;
+
+          if (t->valid && t->fg[i] == fg && t->bg[i] == bg)
+            continue;
+          t->fg[i] = fg;
+          t->bg[i] = bg;
+          vnc_tty_cell(t, col, row, fg, bg);
+        }
+    }
+  t->valid = TRUE;
+  if (t->len == 0)
+    return TRUE;		// nothing visible changed
+
+  t->len += sprintf(t->buf + t->len, "\x1b[0m\x1b[%d;1H", t->rows + 1);
+  if (write(t->fd, t->buf, t->len) != t->len)
+    t->valid = FALSE;	// partial write, repaint everything next time.
+  return TRUE;
+}
+
+struct draw_ledpanel_data
+{
+  struct ledpanel *out;
+  unsigned char *lut;	// from mkgamma_lut(), or NULL
+  int gamma[3];		// its curvature per channel
+  unsigned char *led;	// last frame written, in panel layout
+  int led_size;
+};
+
+// rg, gg, bg, are gamma values in the range of [-16..0..16], -16 is brightest, 0 is linear, 16 is darkest.
+unsigned char *mkgamma_lut(int rg, int gg, int bg)
+{
+  unsigned char *lut = (unsigned char *)calloc(3, 256);
+
+  unsigned int i;
+
+#define L_POW4(i)    ((i)*(i)*(i)/255*(i)/(255*255))
+#define L_POW3(i)    ((i)*(i)*(i)/        (255*255))
+#define L_POW2(i)        ((i)*(i)/        (255))
+
+#define L_RANGE(o,i)	(32-(o)+(i)*7/8)
+
+  if (rg < 0)
+    for (i = 0; i < 255; i++) lut[i+0*256] = L_RANGE(8, 255-((16+rg)*(255-i)-rg*L_POW2(255-i))/16);
+  else
+    for (i = 0; i < 255; i++) lut[i+0*256] = L_RANGE(8,     ((16-rg)*i      +rg*L_POW2(    i))/16);
+
+  if (gg < 0)
+    for (i = 0; i < 255; i++) lut[i+1*256] = L_RANGE(8, 255-((16+gg)*(255-i)-gg*L_POW2(255-i))/16);
+  else
+    for (i = 0; i < 255; i++) lut[i+1*256] = L_RANGE(8,     ((16-gg)*i      +gg*L_POW2(    i))/16);
+
+  if (bg < 0)
+    for (i = 0; i < 255; i++) lut[i+2*256] = L_RANGE(8, 255-((16+bg)*(255-i)-bg*L_POW2(255-i))/16);
+  else
+    for (i = 0; i < 255; i++) lut[i+2*256] = L_RANGE(8,     ((16-bg)*i      +bg*L_POW2(    i))/16);
+
+  return lut;
+}
+
+int draw_ledpanel(VncView *view, unsigned char *rgb, int stride, VncRect *dirty, void *data)
+{
+  struct draw_ledpanel_data *d = (struct draw_ledpanel_data *)data;
+  int size = 3 * view->w * view->h;	// chained panels are just a wider buffer
+  unsigned char *p;
+  int h = dirty->h;
+
+  if (d->led_size != size)
+    {
+      free(d->led);
+      d->led = (unsigned char *)calloc(1, size);
+      d->led_size = size;
+    }
+  p = d->led + dirty->y * 3*view->w + dirty->x * 3;
+
+  // led keeps the previous frame, only the dirty part is converted.
+  rgb += (view->x + dirty->x) * 3;
+  rgb += (view->y + dirty->y) * stride;
+
+  while (h-- > 0)
+    {
+      if (d->lut)
+        {
+          int x;
+          for (x = 0; x < 3*dirty->w; x+=3)
+            {
+              p[x+0] = d->lut[rgb[x+0]+0*256];
+              p[x+1] = d->lut[rgb[x+1]+1*256];
+              p[x+2] = d->lut[rgb[x+2]+2*256];
+            }
+        }
+      else
+        memcpy(p, rgb, 3*dirty->w);
+      rgb += stride;
+      p += 3*view->w;
+    }
+  ledpanel_write_dirty(d->out, d->led, size, 3*view->w, dirty->x, dirty->y, dirty->w, dirty->h);
+  return TRUE;
+}
+
+/*
+ * Control socket, VNC_TINY_CTL=/tmp/vnc.ctl, e.g.
+ *   echo "set view 320x240+0+0; set refresh 100; get stats" | socat - UNIX-CONNECT:/tmp/vnc.ctl
+ * Commands are separated by ';' or newlines, each one answers with one
+ * "ok ..." or "err ..." line. Everything read at once is applied before
+ * the next framebuffer update is handled, without touching the vnc
+ * connection, so a batch takes effect together.
+ * The VNC_TINY_CFG fifo goes through the same parser, there "x y [w h]"
+ * is short for "set view x y [w h]".
+ */
+#define VNC_CTL_CLIENTS	4
+
+typedef struct VncCtlClient
+{
+  int fd;		// -1 when unused
+  char buf[1024];	// an incomplete line
+  int len;
+} VncCtlClient;
+
+typedef struct VncCtl
+{
+  int fd;		// listening socket or -1
+  VncCtlClient client[VNC_CTL_CLIENTS];
+  int fifo;		// legacy VNC_TINY_CFG fifo or -1
+  VncConnection *conn;
+  VncTty *tty;		// console output, or NULL
+  struct draw_ledpanel_data *led;	// ledpanel output, or NULL
+} VncCtl;
+
+#define VNC_CTL_REPLY(...)	do { if (out) fprintf(out, __VA_ARGS__); } while (0)
+
+static const char *vnc_ctl_help =
+  "ok get|set view WxH+X+Y | view X Y [W H] | pos X Y | size WxH | refresh MS | latency MS |"
+  " pan X,Y[@MS] ... [loop] | velocity VX VY | margin PX | fps N |"
+  " encodings LIST | output MODE | gamma off|G|R G B; get desktop | stats\n";
+
+// parse "WxH+X+Y", "X Y [W H]" or (for pos/size) part of it into view.
+static int vnc_ctl_geometry(char *key, char *arg, VncView *view)
+{
+  if (!arg) return FALSE;
+  if (!strcmp(key, "size"))
+    return sscanf(arg, "%dx%d", &view->w, &view->h) == 2;
+  if (!strcmp(key, "pos"))
+    return sscanf(arg, "%d %d", &view->x, &view->y) == 2;
+  if (strchr(arg, 'x'))
+    return sscanf(arg, "%dx%d+%d+%d", &view->w, &view->h, &view->x, &view->y) >= 2;
+  return sscanf(arg, "%d %d %d %d", &view->x, &view->y, &view->w, &view->h) >= 1;
+}
+
+void vnc_ctl_command(VncCtl *ctl, char *cmd, FILE *out)
+{
+  VncConnection *conn = ctl->conn;
+  VncView *view = &conn->view;
+  char *verb, *key, *arg, *save;
+  char legacy[1100];
+
+  while (isspace((unsigned char)*cmd)) cmd++;
+  if (!*cmd)
+    return;
+  if (isdigit((unsigned char)*cmd) || *cmd == '-')
+    {
+      snprintf(legacy, sizeof(legacy), "set view %s", cmd);
+      cmd = legacy;
+    }
+  verb = strtok_r(cmd, " \t\r\n", &save);
+  key = strtok_r(NULL, " \t\r\n", &save);
+  arg = strtok_r(NULL, "\r\n", &save);
+  if (!strcmp(verb, "help"))
+    {
+      VNC_CTL_REPLY("%s", vnc_ctl_help);
+      return;
+    }
+  if (!key || (strcmp(verb, "get") && strcmp(verb, "set")))
+    {
+      VNC_CTL_REPLY("err unknown command '%s', try help\n", verb);
+      return;
+    }
+
+  if (!strcmp(key, "view") || !strcmp(key, "pos") || !strcmp(key, "size"))
+    {
+      if (*verb == 's')
+        {
+          VncView next = *view;
+          if (!vnc_ctl_geometry(key, arg, &next))
+            {
+              VNC_CTL_REPLY("err set %s: bad geometry\n", key);
+              return;
+            }
+          vnc_connection_set_velocity(conn, 0, 0);	// stops panning
+          vnc_connection_move_view(conn, next.x, next.y, next.w, next.h);
+        }
+      VNC_CTL_REPLY("ok view %dx%d+%d+%d\n", view->w, view->h, view->x, view->y);
+    }
+  else if (!strcmp(key, "desktop") && *verb == 'g')
+    {
+      if (conn->priv->width)
+        VNC_CTL_REPLY("ok desktop %dx%d %s%s\n", conn->priv->width, conn->priv->height, conn->priv->name,
+                      vnc_connection_has_error(conn) ? " (offline)" : "");
+      else
+        VNC_CTL_REPLY("ok desktop offline\n");
+    }
+  else if (!strcmp(key, "stats") && *verb == 'g')
+    {
+      VNC_CTL_REPLY("ok ");
+      if (out) vnc_connection_print_stats(conn, out);
+    }
+  else if (!strcmp(key, "refresh") || !strcmp(key, "latency"))
+    {
+      int *ms = (key[0] == 'r') ? &conn->msec_refresh : &conn->latency_ms;
+      if (*verb == 's')
+        {
+          if (!arg || atoi(arg) < 10)
+            {
+              VNC_CTL_REPLY("err set %s: needs at least 10 ms\n", key);
+              return;
+            }
+          *ms = atoi(arg);
+        }
+      VNC_CTL_REPLY("ok %s %d\n", key, *ms);
+    }
+  else if (!strcmp(key, "margin") || !strcmp(key, "fps"))
+    {
+      int *v = (key[0] == 'm') ? &conn->margin : &conn->pan.fps;
+      if (*verb == 's')
+        {
+          if (!arg || atoi(arg) < (key[0] == 'm' ? 0 : 1))
+            {
+              VNC_CTL_REPLY("err set %s: bad value\n", key);
+              return;
+            }
+          *v = atoi(arg);
+        }
+      VNC_CTL_REPLY("ok %s %d\n", key, *v);
+    }
+  else if (!strcmp(key, "pan") || !strcmp(key, "velocity"))
+    {
+      VncPan *pan = &conn->pan;
+      int vx, vy;
+
+      if (*verb == 's' && key[0] == 'p' && !vnc_connection_set_pan(conn, arg ? arg : ""))
+        {
+          VNC_CTL_REPLY("err set pan: X,Y[@MS] ... [loop]\n");
+          return;
+        }
+      if (*verb == 's' && key[0] == 'v')
+        {
+          if (!arg || sscanf(arg, "%d %d", &vx, &vy) != 2)
+            {
+              VNC_CTL_REPLY("err set velocity: VX VY in px/s\n");
+              return;
+            }
+          vnc_connection_set_velocity(conn, vx, vy);
+        }
+      if (pan->n)
+        VNC_CTL_REPLY("ok pan to %d,%d (%d of %d)%s\n", pan->px[pan->i], pan->py[pan->i], pan->i + 1, pan->n, pan->loop ? " loop" : "");
+      else if (pan->vx || pan->vy)
+        VNC_CTL_REPLY("ok velocity %d %d\n", pan->vx, pan->vy);
+      else
+        VNC_CTL_REPLY("ok pan idle\n");
+    }
+  else if (!strcmp(key, "encodings"))
+    {
+      if (*verb == 's')
+        {
+          u_int32_t encodings[16];
+          if (!arg)
+            {
+              VNC_CTL_REPLY("err set encodings: needs a list like tight,raw\n");
+              return;
+            }
+          free(conn->encodings);
+          conn->encodings = strdup(arg);
+          if (!vnc_connection_has_error(conn))
+            vnc_connection_set_encodings(conn, vnc_connection_encodings(conn->encodings, encodings), encodings);
+        }
+      VNC_CTL_REPLY("ok encodings %s\n", conn->encodings ? conn->encodings : "default");
+    }
+  else if (!strcmp(key, "output"))
+    {
+      static const char *modes[] = { "1", "ramp", "256", "truecolor" };
+      if (!ctl->tty)
+        {
+          VNC_CTL_REPLY("%s\n", *verb == 's' ? "err set output: only for VNC_TINY_STDOUT" : "ok output ledpanel");
+          return;
+        }
+      if (*verb == 's')
+        {
+          if (!arg)
+            {
+              VNC_CTL_REPLY("err set output: needs 1, 256, truecolor or ramp[,half]\n");
+              return;
+            }
+          free(ctl->tty->fg); free(ctl->tty->bg); free(ctl->tty->buf);
+          vnc_tty_init(ctl->tty, ctl->tty->fd, arg);
+          write(ctl->tty->fd, "\x1b[2J", 4);
+          vnc_connection_redraw(conn);
+        }
+      VNC_CTL_REPLY("ok output %s%s\n", modes[ctl->tty->mode], ctl->tty->half ? ",half" : "");
+    }
+  else if (!strcmp(key, "gamma"))
+    {
+      struct draw_ledpanel_data *d = ctl->led;
+      if (!d)
+        {
+          VNC_CTL_REPLY("err gamma: only for the ledpanel\n");
+          return;
+        }
+      if (*verb == 's')
+        {
+          int g[3];
+          int n = arg ? sscanf(arg, "%d %d %d", &g[0], &g[1], &g[2]) : 0;
+
+          if (n == 1) g[1] = g[2] = g[0];
+          if (arg && !strcmp(arg, "off"))
+            {
+              free(d->lut);
+              d->lut = NULL;
+            }
+          else if ((n == 1 || n == 3) && g[0] >= -16 && g[0] <= 16 && g[1] >= -16 && g[1] <= 16 && g[2] >= -16 && g[2] <= 16)
+            {
+              free(d->lut);
+              d->lut = mkgamma_lut(g[0], g[1], g[2]);
+              memcpy(d->gamma, g, sizeof(d->gamma));
+            }
+          else
+            {
+              VNC_CTL_REPLY("err set gamma: off, or 1 or 3 values -16..16\n");
+              return;
+            }
+          vnc_connection_redraw(conn);
+        }
+      if (d->lut)
+        VNC_CTL_REPLY("ok gamma %d %d %d\n", d->gamma[0], d->gamma[1], d->gamma[2]);
+      else
+        VNC_CTL_REPLY("ok gamma off\n");
+    }
+  else
+    VNC_CTL_REPLY("err %s %s: unknown, try help\n", verb, key);
+}
+
+// run all complete lines in buf, returns the length of the incomplete rest.
+static int vnc_ctl_lines(VncCtl *ctl, char *buf, int len, FILE *out)
+{
+  char *start = buf;
+  char *p;
+
+  while ((p = memchr(start, '\n', len - (start - buf))) || (p = memchr(start, ';', len - (start - buf))))
+    {
+      char *semi = memchr(start, ';', p - start);
+      if (semi) p = semi;
+      *p = '\0';
+      vnc_ctl_command(ctl, start, out);
+      start = p + 1;
+    }
+  len -= start - buf;
+  memmove(buf, start, len);
+  return len;
+}
+
+int vnc_ctl_init(VncCtl *ctl, VncConnection *conn, char *path, char *fifo)
+{
+  int i;
+
+  memset(ctl, 0, sizeof(*ctl));
+  ctl->fd = -1;
+  ctl->fifo = -1;
+  for (i = 0; i < VNC_CTL_CLIENTS; i++)
+    ctl->client[i].fd = -1;
+  ctl->conn = conn;
+  conn->ctl = ctl;
+
+  if (fifo)
+    {
+      mkfifo(fifo, 0777);
+      ctl->fifo = open(fifo, O_RDONLY|O_NONBLOCK);
+    }
+  if (path)
+    {
+      struct sockaddr_un addr;
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+      unlink(path);
+      ctl->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (ctl->fd < 0 || bind(ctl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(ctl->fd, 4) < 0)
+        {
+          perror(path);
+          if (ctl->fd >= 0) close(ctl->fd);
+          ctl->fd = -1;
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+static int vnc_ctl_fdset(VncCtl *ctl, fd_set *rfds, int maxfd)
+{
+  int i;
+
+  if (!ctl)
+    return maxfd;
+  if (ctl->fifo >= 0)
+    {
+      // a fifo without writer is always readable, only look when there is data.
+      int nbytes = 0;
+      ioctl(ctl->fifo, FIONREAD, &nbytes);
+      if (nbytes > 0)
+        {
+          FD_SET(ctl->fifo, rfds);
+          if (ctl->fifo > maxfd) maxfd = ctl->fifo;
+        }
+    }
+  if (ctl->fd >= 0)
+    {
+      FD_SET(ctl->fd, rfds);
+      if (ctl->fd > maxfd) maxfd = ctl->fd;
+    }
+  for (i = 0; i < VNC_CTL_CLIENTS; i++)
+    if (ctl->client[i].fd >= 0)
+      {
+        FD_SET(ctl->client[i].fd, rfds);
+        if (ctl->client[i].fd > maxfd) maxfd = ctl->client[i].fd;
+      }
+  return maxfd;
+}
+
+// returns TRUE when something was read.
+static int vnc_ctl_serve(VncCtl *ctl, fd_set *rfds)
+{
+  int done = FALSE;
+  int i;
+
+  if (!ctl)
+    return FALSE;
+  if (ctl->fifo >= 0 && FD_ISSET(ctl->fifo, rfds))
+    {
+      char buf[1024];
+      int n = read(ctl->fifo, buf, sizeof(buf)-1);
+      if (n > 0)
+        {
+          if (buf[n-1] != '\n') buf[n++] = '\n';
+          vnc_ctl_lines(ctl, buf, n, NULL);
+        }
+      done = TRUE;
+    }
+  if (ctl->fd >= 0 && FD_ISSET(ctl->fd, rfds))
+    {
+      int fd = accept(ctl->fd, NULL, NULL);
+      for (i = 0; fd >= 0 && i < VNC_CTL_CLIENTS; i++)
+        if (ctl->client[i].fd < 0)
+          {
+            ctl->client[i].fd = fd;
+            ctl->client[i].len = 0;
+            fd = -1;
+          }
+      if (fd >= 0)
+        {
+          write(fd, "err busy\n", 9);
+          close(fd);
+        }
+      done = TRUE;
+    }
+  for (i = 0; i < VNC_CTL_CLIENTS; i++)
+    {
+      VncCtlClient *c = &ctl->client[i];
+      char *reply = NULL;
+      size_t reply_len = 0;
+      FILE *out;
+      int n;
+
+      if (c->fd < 0 || !FD_ISSET(c->fd, rfds))
+        continue;
+      done = TRUE;
+      n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+      if (n <= 0)
+        {
+          close(c->fd);
+          c->fd = -1;
+          continue;
+        }
+      c->len += n;
+      out = open_memstream(&reply, &reply_len);
+      c->len = vnc_ctl_lines(ctl, c->buf, c->len, out);
+      if (c->len == sizeof(c->buf) - 1)
+        {
+          fprintf(out, "err line too long\n");
+          c->len = 0;
+        }
+      fclose(out);
+      if (reply_len)
+        write(c->fd, reply, reply_len);
+      free(reply);
+    }
+  return done;
+}
+
+// sleep while offline, but keep serving the control socket.
+void vnc_ctl_wait(VncCtl *ctl, long long usec)
+{
+  struct timeval tval;
+  fd_set rfds;
+  int n;
+
+  if (!ctl)
+    {
+      usleep(usec);
+      return;
+    }
+  FD_ZERO(&rfds);
+  n = vnc_ctl_fdset(ctl, &rfds, -1);
+  tval.tv_sec = usec / 1000000;
+  tval.tv_usec = usec % 1000000;
+  if (select(n+1, &rfds, NULL, NULL, &tval) > 0)
+    vnc_ctl_serve(ctl, &rfds);
+}
+
+
+/*
+ * Mosaic: several vnc servers, each one showing its view on a region
+ * of one panel (or a wall of chained panels), all driven from one select().
+ * The per connection expose only copies into the composite frame,
+ * the real output sees one expose per loop iteration.
+ */
+typedef struct VncMosaic
+{
+  VncView panel;		// the whole panel wall
+  unsigned char *rgb;
+  VncRect dirty;
+  VncExposeFunc expose_cb;	// real output
+  void *expose_cb_data;
+  struct ledpanel *out;		// for ledpanel_flush(), or NULL
+} VncMosaic;
+
+typedef struct VncMosaicTile
+{
+  VncMosaic *mosaic;
+  VncConnection *conn;
+  int x, y;			// position on the panel wall
+  struct VncState *state;	// VNC_TINY_STATE.N, or NULL
+} VncMosaicTile;
+
+// VNC_TINY_STATE, further down
+struct VncState;
+static void vnc_state_check(struct VncState *st);
+static volatile sig_atomic_t vnc_state_quit;
+
+static int vnc_mosaic_expose(VncView *view, unsigned char *rgb, int stride, VncRect *dirty, void *data)
+{
+  VncMosaicTile *t = (VncMosaicTile *)data;
+  VncMosaic *m = t->mosaic;
+  int x = t->x + dirty->x, y = t->y + dirty->y;
+  int w = dirty->w, h = dirty->h;
+
+  rgb += (view->y + dirty->y) * stride + (view->x + dirty->x) * 3;
+  if (x + w > m->panel.w) w = m->panel.w - x;
+  if (y + h > m->panel.h) h = m->panel.h - y;
+  if (w <= 0 || h <= 0)
+    return FALSE;
+  vnc_rect_union(&m->dirty, x, y, w, h);
+  while (h-- > 0)
+    {
+      memcpy(m->rgb + 3 * (y++ * m->panel.w + x), rgb, 3 * w);
+      rgb += stride;
+    }
+  return TRUE;
+}
+
+/*
+ * Parse HOST[:PORT][/WxH+X+Y]@WxH+X+Y, the optional part is the view on
+ * the remote desktop, the second geometry is the panel region it goes to.
+ * Returns NULL when that region is not all on the panel.
+ */
+VncConnection *vnc_mosaic_add(VncMosaic *m, VncMosaicTile *t, char *spec)
+{
+  char host[256], *port, *view, *region;
+  VncConnection *conn;
+  int vw = 0, vh = 0, vx = 0, vy = 0;
+  int rw = m->panel.w, rh = m->panel.h;
+
+  snprintf(host, sizeof(host), "%s", spec);
+  t->x = t->y = 0;
+  if ((region = strrchr(host, '@')))
+    {
+      *region++ = '\0';
+      sscanf(region, "%dx%d+%d+%d", &rw, &rh, &t->x, &t->y);
+    }
+  if (rw <= 0 || rh <= 0 || t->x < 0 || t->y < 0 ||
+      t->x + rw > m->panel.w || t->y + rh > m->panel.h)
+    {
+      fprintf(stderr, "%s: %dx%d+%d+%d is not on the %dx%d panel\n", spec, rw, rh, t->x, t->y, m->panel.w, m->panel.h);
+      return NULL;
+    }
+  if ((view = strchr(host, '/')))
+    {
+      *view++ = '\0';
+      sscanf(view, "%dx%d+%d+%d", &vw, &vh, &vx, &vy);
+    }
+  if ((port = strchr(host, ':')))
+    *port++ = '\0';
+
+  conn = connect_vnc_server(host, port);
+  conn->panel.w = rw;
+  conn->panel.h = rh;
+  conn->view.x = vx;
+  conn->view.y = vy;
+  conn->view.w = vw ? vw : rw;
+  conn->view.h = vh ? vh : rh;
+  vnc_connection_clamp_view(conn);
+  conn->expose_cb = vnc_mosaic_expose;
+  conn->expose_cb_data = (void *)t;
+  conn->async = TRUE;
+  t->mosaic = m;
+  t->conn = conn;
+  return conn;
+}
+
+// returns TRUE when SIGTERM or SIGINT ended it, see vnc_state_init().
+int vnc_mosaic_run(VncMosaic *m, VncMosaicTile *tiles, int n)
+{
+  while (!vnc_state_quit)
+    {
+      long long now = now_usec();
+      long long wait = 1000000;
+      struct timeval tval;
+      fd_set rfds, wfds;
+      int i, fd, write, maxfd = -1;
+
+      FD_ZERO(&rfds);
+      FD_ZERO(&wfds);
+      for (i = 0; i < n; i++)
+        {
+          VncConnection *conn = tiles[i].conn;
+
+          if (vnc_connection_has_error(conn))
+            {
+              // never blocks, the other tiles keep going meanwhile.
+              long long w = vnc_connection_offline(conn);
+              if (w)
+                {
+                  if (w < wait) wait = w;
+                  if ((fd = vnc_connection_connecting(conn, &write)) >= 0)
+                    {
+                      FD_SET(fd, write ? &wfds : &rfds);
+                      if (fd > maxfd) maxfd = fd;
+                    }
+                  continue;
+                }
+              now = now_usec();
+            }
+          if (now >= conn->next_refresh)
+            {
+              vnc_connection_refresh(conn);
+              conn->next_refresh = now + 1000LL * conn->msec_refresh;
+            }
+          if (conn->next_refresh - now < wait) wait = conn->next_refresh - now;
+          FD_SET(conn->fd, &rfds);
+          if (conn->fd > maxfd) maxfd = conn->fd;
+        }
+      tval.tv_sec = wait / 1000000;
+      tval.tv_usec = wait % 1000000;
+      if (select(maxfd+1, &rfds, &wfds, NULL, &tval) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          perror("select");
+          return FALSE;
+        }
+      for (i = 0; i < n; i++)
+        {
+          VncConnection *conn = tiles[i].conn;
+
+          if (vnc_connection_has_error(conn))
+            continue;
+          if (!FD_ISSET(conn->fd, &rfds))
+            {
+              vnc_connection_catch_up(conn);	// quiet now, show what was skipped
+              continue;
+            }
+          vnc_connection_dispatch(conn);
+          conn->next_refresh = now_usec() + 1000LL * conn->msec_refresh;
+        }
+
+      if (m->dirty.w > 0 && m->dirty.h > 0)
+        {
+          VncRect dirty = m->dirty;
+          memset(&m->dirty, 0, sizeof(m->dirty));
+          m->expose_cb(&m->panel, m->rgb, 3 * m->panel.w, &dirty, m->expose_cb_data);
+        }
+      ledpanel_flush(m->out);	// LEDPANEL_POWER, a still wall brightens up again
+      for (i = 0; i < n; i++)
+        vnc_state_check(tiles[i].state);
+    }
+  return TRUE;
+}
+
+/*
+ * Raw video ingest, e.g.
+ *   ffmpeg -i movie.mp4 -f rawvideo -pix_fmt yuv420p -s 160x120 - | vnc_tiny_view -i 160x120:yuv420p
+ * Frames are box filtered down to the panel, quantized to the panel depth
+ * and handed to the same expose_cb as the vnc path.
+ * Pipes and sockets are drained to the newest complete frame before each
+ * panel write; regular files are played back at the given frame rate.
+ */
+#define VNC_INGEST_RGB24	0
+#define VNC_INGEST_YUV420P	1
+
+typedef struct VncIngest
+{
+  int fd;
+  int w, h;			// input frame size
+  int format;
+  int msec_refresh;
+  int frame_size;
+  unsigned char *frame;		// complete frame, ready to be shown
+  unsigned char *spare;		// frame being read
+  VncScaler luma;		// rgb24: all three channels, yuv420p: Y plane
+  VncScaler chroma;		// yuv420p: U and V planes
+  unsigned char *yuv;		// panel sized Y, U, V planes
+  unsigned char quant[256];
+  long frames_in;
+  long frames_shown;
+} VncIngest;
+
+int vnc_ingest_init(VncIngest *in, int fd, char *spec, int pw, int ph)
+{
+  char fmt[32] = "rgb24";
+  int fps = 25;
+  int bits = 3;		// ledpanel uses the 3 most significant bits per channel
+  int i, n;
+
+  memset(in, 0, sizeof(*in));
+  n = sscanf(spec, "%dx%d:%31[a-z0-9]@%d", &in->w, &in->h, fmt, &fps);
+  if (n < 2 || in->w < 1 || in->h < 1)
+    n = sscanf(spec, "%dx%d@%d", &in->w, &in->h, &fps);
+  if (n < 2 || in->w < 1 || in->h < 1 || fps < 1)
+    {
+      fprintf(stderr, "ingest: bad frame spec '%s', want WxH[:rgb24|yuv420p][@fps]\n", spec);
+      return FALSE;
+    }
+
+  in->fd = fd;
+  in->msec_refresh = 1000 / fps;
+  if (!strcmp(fmt, "rgb24"))
+    {
+      in->format = VNC_INGEST_RGB24;
+      in->frame_size = 3 * in->w * in->h;
+      vnc_scaler_init(&in->luma, in->w, in->h, pw, ph);
+    }
+  else if (!strcmp(fmt, "yuv420p"))
+    {
+      in->format = VNC_INGEST_YUV420P;
+      in->frame_size = in->w * in->h + 2 * ((in->w+1)/2) * ((in->h+1)/2);
+      vnc_scaler_init(&in->luma, in->w, in->h, pw, ph);
+      vnc_scaler_init(&in->chroma, (in->w+1)/2, (in->h+1)/2, pw, ph);
+      in->yuv = (unsigned char *)calloc(3, pw * ph);
+    }
+  else
+    {
+      fprintf(stderr, "ingest: unknown pixel format '%s'\n", fmt);
+      return FALSE;
+    }
+  in->frame = (unsigned char *)malloc(in->frame_size);
+  in->spare = (unsigned char *)malloc(in->frame_size);
+
+  if (getenv("VNC_TINY_BITS")) bits = atoi(getenv("VNC_TINY_BITS"));
+  if (bits < 1 || bits > 8) bits = 8;
+  for (i = 0; i < 256; i++)
+    {
+      int v = i + ((1 << (8 - bits)) >> 1);
+      if (v > 255) v = 255;
+      in->quant[i] = v & ~((1 << (8 - bits)) - 1);
+    }
+  return TRUE;
+}
+
+static int vnc_ingest_read(VncIngest *in)
+{
+  unsigned char *p = in->spare;
+  int len = in->frame_size;
+
+  while (len > 0)
+    {
+      int r = read(in->fd, p, len);
+      if (r <= 0) return FALSE;
+      len -= r;
+      p += r;
+    }
+  p = in->frame;
+  in->frame = in->spare;
+  in->spare = p;
+  in->frames_in++;
+  return TRUE;
+}
+
+static inline unsigned char vnc_clamp8(int v)
+{
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static void vnc_ingest_convert(VncIngest *in, unsigned char *rgb, int pw, int ph)
+{
+  int i, n = pw * ph;
+
+  if (in->format == VNC_INGEST_RGB24)
+    {
+      vnc_scaler_run(&in->luma, in->frame, 3 * in->w, rgb, 3 * pw, 3);
+    }
+  else
+    {
+      int cw = (in->w+1)/2, ch = (in->h+1)/2;
+      unsigned char *y = in->yuv, *u = y + n, *v = u + n;
+      unsigned char *src_u = in->frame + in->w * in->h;
+
+      vnc_scaler_run(&in->luma, in->frame, in->w, y, pw, 1);
+      vnc_scaler_run(&in->chroma, src_u, cw, u, pw, 1);
+      vnc_scaler_run(&in->chroma, src_u + cw * ch, cw, v, pw, 1);
+      for (i = 0; i < n; i++)
+        {
+          // BT.601, limited range, 8.8 fixed point
+          int c = 298 * (y[i] - 16) + 128;
+          int d = u[i] - 128;
+          int e = v[i] - 128;
+          rgb[3*i+0] = vnc_clamp8((c + 409 * e) >> 8);
+          rgb[3*i+1] = vnc_clamp8((c - 100 * d - 208 * e) >> 8);
+          rgb[3*i+2] = vnc_clamp8((c + 516 * d) >> 8);
+        }
+    }
+  for (i = 0; i < 3 * n; i++)
+    rgb[i] = in->quant[rgb[i]];
+}
+
+int vnc_ingest_run(VncIngest *in, VncView *view, VncExposeFunc expose_cb, void *expose_cb_data)
+{
+  unsigned char *rgb = (unsigned char *)calloc(3 * view->w, view->h);
+  VncRect all = { 0, 0, view->w, view->h };
+  struct stat st;
+  int paced = (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode));
+  long long next = now_usec();
+
+  if (!vnc_ingest_read(in))
+    return FALSE;
+  for (;;)
+    {
+      long long now = now_usec();
+      int nbytes = 0;
+
+      if (paced)
+        {
+          if (next > now) usleep(next - now);
+        }
+      else
+        {
+          if (next > now)
+            {
+              // keep replacing the pending frame until the panel is due.
+              fd_set rfds;
+              struct timeval tval;
+              FD_ZERO(&rfds);
+              FD_SET(in->fd, &rfds);
+              tval.tv_sec = (next - now) / 1000000;
+              tval.tv_usec = (next - now) % 1000000;
+              if (select(in->fd+1, &rfds, NULL, NULL, &tval) > 0)
+                {
+                  if (!vnc_ingest_read(in)) break;
+                  continue;
+                }
+            }
+          // skip everything that piled up while we were writing.
+          while (ioctl(in->fd, FIONREAD, &nbytes) == 0 && nbytes >= in->frame_size)
+            if (!vnc_ingest_read(in)) break;
+        }
+
+      vnc_ingest_convert(in, rgb, view->w, view->h);
+      expose_cb(view, rgb, 3 * view->w, &all, expose_cb_data);
+      in->frames_shown++;
+
+      next += 1000LL * in->msec_refresh;
+      now = now_usec();
+      if (next < now) next = now;
+      if (!vnc_ingest_read(in))
+        break;
+    }
+  fprintf(stderr, "ingest: %ld frames read, %ld shown, %ld dropped\n",
+          in->frames_in, in->frames_shown, in->frames_in - in->frames_shown);
+  free(rgb);
+  return TRUE;
+}
+
+/*
+ * Latency probe, VNC_TINY_PROBE=100 with ../latency_probe.py under the view.
+ * The 4x4 grid encodes the wall clock in ms at the source: red cells are
+ * the bits, green cells a hash of them, blue the inverse of red. Each new
+ * timestamp is compared with the wall clock right after the frame was
+ * handed to the output, percentiles are printed every 100 samples.
+ */
+#define VNC_PROBE_SAMPLES	1024
+#define VNC_PROBE_HASH(ts)	(((ts) * 40503u) & 0xffff)
+
+typedef struct VncProbe
+{
+  VncExposeFunc expose_cb;	// real output
+  void *expose_cb_data;
+  int every;			// print after this many samples
+  int last;			// last timestamp seen, or -1
+  long n;			// samples taken
+  long torn;			// frames with an invalid pattern
+  int ms[VNC_PROBE_SAMPLES];	// the latest latencies
+} VncProbe;
+
+static int vnc_probe_cmp(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+static void vnc_probe_report(VncProbe *p)
+{
+  int n = p->n < VNC_PROBE_SAMPLES ? p->n : VNC_PROBE_SAMPLES;
+  int sorted[VNC_PROBE_SAMPLES];
+
+  memcpy(sorted, p->ms, n * sizeof(int));
+  qsort(sorted, n, sizeof(int), vnc_probe_cmp);
+  fprintf(stderr, "probe: %ld samples, %ld torn, latency of the last %d p50 %d p90 %d p99 %d max %d ms\n",
+          p->n, p->torn, n, sorted[n/2], sorted[n*9/10], sorted[n*99/100], sorted[n-1]);
+}
+
+static int vnc_probe_expose(VncView *view, unsigned char *rgb, int stride, VncRect *dirty, void *data)
+{
+  VncProbe *p = (VncProbe *)data;
+  int ret = p->expose_cb(view, rgb, stride, dirty, p->expose_cb_data);
+  struct timespec now;
+  int ts = 0, hash = 0, i, ms;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  for (i = 0; i < 16; i++)
+    {
+      int x = view->x + (2 * (i % 4) + 1) * view->w / 8;
+      int y = view->y + (2 * (i / 4) + 1) * view->h / 8;
+      unsigned char *c = rgb + y * stride + 3 * x;
+
+      if ((c[0] > 127) == (c[2] > 127))
+        return ret;		// not the probe, or mid transition
+      ts |= (c[0] > 127) << i;
+      hash |= (c[1] > 127) << i;
+    }
+  if (ts == p->last)
+    return ret;
+  p->last = ts;
+  if (hash != VNC_PROBE_HASH(ts))
+    {
+      p->torn++;
+      return ret;
+    }
+  ms = ((now.tv_sec * 1000LL + now.tv_nsec / 1000000) - ts) & 0xffff;
+  if (ms > 30000)
+    return ret;			// the clocks disagree
+  p->ms[p->n++ % VNC_PROBE_SAMPLES] = ms;
+  if (!(p->n % p->every))
+    vnc_probe_report(p);
+  return ret;
+}
+
+/*
+ * Startup state, VNC_TINY_STATE=/var/lib/vnc_tiny_view.state:
+ * the address, desktop size and pixel format of the server, and the last
+ * frame shown. At start the frame goes to the panel before anything else
+ * and the address is tried before DNS. Written after a connect when the
+ * server changed, at most every VNC_STATE_SAVE_SEC when the frame did,
+ * and on SIGTERM or SIGINT, renamed into place so a power cut leaves the
+ * old one.
+ */
+#define VNC_STATE_MAGIC		"VNCTINY1"
+#define VNC_STATE_SAVE_SEC	60
+
+typedef struct VncStateHeader
+{
+  char magic[8];
+  char host[64];
+  char port[16];
+  struct sockaddr_storage addr;
+  u_int32_t addrlen;
+  u_int32_t width, height;	// desktop
+  VncPixelFormat fmt;
+  u_int32_t panel_w, panel_h;	// the frame that follows
+} VncStateHeader;
+
+typedef struct VncState
+{
+  VncExposeFunc expose_cb;	// real output
+  void *expose_cb_data;
+  VncConnection *conn;
+  char *path;
+  VncStateHeader hdr;		// as on disk
+  unsigned char *frame;		// as on the panel
+  int changed;			// frame differs from the file
+  long long next_save;		// usec
+} VncState;
+
+static void vnc_state_header(VncState *st, VncStateHeader *hdr)
+{
+  VncConnection *conn = st->conn;
+
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, VNC_STATE_MAGIC, sizeof(hdr->magic));
+  snprintf(hdr->host, sizeof(hdr->host), "%s", conn->host);
+  snprintf(hdr->port, sizeof(hdr->port), "%s", conn->port ? conn->port : "5900");
+  memcpy(&hdr->addr, &conn->addr, sizeof(hdr->addr));
+  hdr->addrlen = conn->addrlen;
+  hdr->width = conn->priv->width;
+  hdr->height = conn->priv->height;
+  hdr->fmt = conn->priv->fmt;
+  hdr->panel_w = conn->panel.w;
+  hdr->panel_h = conn->panel.h;
+}
+
+static void vnc_state_save(VncState *st)
+{
+  int size = 3 * st->hdr.panel_w * st->hdr.panel_h;
+  char *tmp = (char *)malloc(strlen(st->path) + 5);
+  int fd;
+
+  sprintf(tmp, "%s.new", st->path);
+  if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 ||
+      write(fd, &st->hdr, sizeof(st->hdr)) != sizeof(st->hdr) ||
+      write(fd, st->frame, size) != size ||
+      fsync(fd) < 0 || close(fd) < 0 || rename(tmp, st->path) < 0)
+    {
+      perror(tmp);
+      if (fd >= 0) close(fd);
+    }
+  free(tmp);
+  st->changed = FALSE;
+  st->next_save = now_usec() + VNC_STATE_SAVE_SEC * 1000000LL;
+}
+
+// also called from the main loop, a frame that stays is saved as well.
+static void vnc_state_check(VncState *st)
+{
+  if (st && st->changed && now_usec() >= st->next_save)
+    vnc_state_save(st);
+}
+
+static void vnc_state_signal(int sig)
+{
+  vnc_state_quit = sig;
+}
+
+static int vnc_state_expose(VncView *view, unsigned char *rgb, int stride, VncRect *dirty, void *data)
+{
+  VncState *st = (VncState *)data;
+  int ret = st->expose_cb(view, rgb, stride, dirty, st->expose_cb_data);
+  VncStateHeader hdr;
+  int y;
+
+  if (st->conn->fd >= 0 && !st->conn->connecting && view->w == (int)st->hdr.panel_w && view->h == (int)st->hdr.panel_h)
+    {
+      for (y = 0; y < dirty->h; y++)
+        memcpy(st->frame + 3 * ((dirty->y + y) * view->w + dirty->x),
+               rgb + (view->y + dirty->y + y) * stride + 3 * (view->x + dirty->x), 3 * dirty->w);
+      st->changed = TRUE;
+    }
+  if (st->conn->priv->width)
+    {
+      vnc_state_header(st, &hdr);
+      if (memcmp(&hdr, &st->hdr, sizeof(hdr)))
+        {
+          st->hdr = hdr;	// a new server, or it changed
+          vnc_state_save(st);
+        }
+    }
+  vnc_state_check(st);
+  return ret;
+}
+
+// paints the cached frame, if it is for this server and panel.
+static void vnc_state_init(VncState *st, VncConnection *conn, char *path)
+{
+  struct sigaction sa;
+  VncStateHeader hdr;
+  int size = 3 * conn->panel.w * conn->panel.h;
+  int fd;
+
+  memset(st, 0, sizeof(*st));
+  st->conn = conn;
+  st->path = path;
+  st->frame = (unsigned char *)calloc(1, size);
+  st->next_save = now_usec() + VNC_STATE_SAVE_SEC * 1000000LL;
+  vnc_state_header(st, &st->hdr);
+  st->expose_cb = conn->expose_cb;
+  st->expose_cb_data = conn->expose_cb_data;
+  conn->expose_cb = vnc_state_expose;
+  conn->expose_cb_data = (void *)st;
+  // no SA_RESTART, select() and read() return and the main loop ends.
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = vnc_state_signal;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return;
+  if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+      !memcmp(hdr.magic, VNC_STATE_MAGIC, sizeof(hdr.magic)) &&
+      !strcmp(hdr.host, st->hdr.host) && !strcmp(hdr.port, st->hdr.port) &&
+      hdr.panel_w == st->hdr.panel_w && hdr.panel_h == st->hdr.panel_h &&
+      hdr.addrlen <= sizeof(conn->addr) &&
+      read(fd, st->frame, size) == size)
+    {
+      VncView panel = { 0, 0, conn->panel.w, conn->panel.h, 0 };
+      VncRect all = { 0, 0, conn->panel.w, conn->panel.h };
+
+      st->hdr = hdr;
+      memcpy(&conn->addr, &hdr.addr, sizeof(conn->addr));
+      conn->addrlen = hdr.addrlen;
+      st->expose_cb(&panel, st->frame, 3 * panel.w, &all, st->expose_cb_data);
+      fprintf(stderr, "%s: last frame shown, %dx%d desktop\n", path, hdr.width, hdr.height);
+    }
+  close(fd);
+}
+
+/*
+ * Replay of a VNC_TINY_RECORD recording, as fast as it decodes:
+ * vnc_tiny_view --replay session.vnc [--expect golden.rgb] [--save out.rgb]
+ * Everything the client would send is dropped, so the same VNC_TINY_VIEW,
+ * VNC_TINY_PANEL and VNC_TINY_ENCODINGS as during the recording must be
+ * given. The last frame handed to the output is compared byte for byte
+ * with the golden .rgb file. LEDPANEL=null leaves only the decode time.
+ */
+typedef struct VncReplay
+{
+  VncExposeFunc expose_cb;	// real output
+  void *expose_cb_data;
+  unsigned char *frame;		// last frame exposed, panel.w x panel.h
+  VncView panel;
+  long exposed;
+} VncReplay;
+
+static int vnc_replay_expose(VncView *view, unsigned char *rgb, int stride, VncRect *dirty, void *data)
+{
+  VncReplay *r = (VncReplay *)data;
+  int y;
+
+  if (!r->frame || view->w != r->panel.w || view->h != r->panel.h)
+    {
+      free(r->frame);
+      r->panel = *view;
+      r->frame = (unsigned char *)calloc(3 * view->w, view->h);
+    }
+  for (y = 0; y < dirty->h; y++)
+    memcpy(r->frame + 3 * ((dirty->y + y) * view->w + dirty->x),
+           rgb + (view->y + dirty->y + y) * stride + 3 * (view->x + dirty->x), 3 * dirty->w);
+  r->exposed++;
+  return r->expose_cb(view, rgb, stride, dirty, r->expose_cb_data);
+}
+
+// returns the exit code: 0 ok, 1 frame differs, 2 replay failed.
+static int vnc_connection_replay(VncConnection *conn, char *file, char *expect, char *save)
+{
+  VncReplay r;
+  long long t0, usec;
+  int size, fd, ret = 0;
+
+  memset(&r, 0, sizeof(r));
+  r.expose_cb = conn->expose_cb;
+  r.expose_cb_data = conn->expose_cb_data;
+  conn->expose_cb = vnc_replay_expose;
+  conn->expose_cb_data = (void *)&r;
+
+  if ((conn->fd = open(file, O_RDONLY)) < 0)
+    {
+      perror(file);
+      return 2;
+    }
+  conn->replay = TRUE;
+  conn->priv->has_error = FALSE;
+  t0 = now_usec();
+  if (!vnc_connection_initialize(conn))
+    {
+      fprintf(stderr, "%s: not a recording of a vnc session\n", file);
+      return 2;
+    }
+  vnc_connection_clamp_view(conn);
+  conn->view.moved = 0;
+  vnc_connection_start(conn, FALSE);
+  while (vnc_connection_dispatch(conn))
+    ;
+  usec = now_usec() - t0;
+  if (usec <= 0) usec = 1;
+
+  vnc_connection_print_stats(conn, stderr);
+  fprintf(stderr, "replay: %lld bytes in %lld ms, %.1f Mbyte/s, %.0f updates/s, %ld frames shown\n",
+          conn->priv->stats.bytes, usec / 1000, conn->priv->stats.bytes / (double)usec,
+          conn->priv->stats.updates * 1e6 / usec, r.exposed);
+
+  if (!r.frame)
+    {
+      fprintf(stderr, "replay: no frame was shown\n");
+      return 2;
+    }
+  size = 3 * r.panel.w * r.panel.h;
+  if (save && ((fd = open(save, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 || write(fd, r.frame, size) != size))
+    {
+      perror(save);
+      ret = 2;
+    }
+  if (save && fd >= 0)
+    close(fd);
+  if (expect)
+    {
+      unsigned char *golden = (unsigned char *)calloc(1, size);
+      int i, n = 0, first = -1;
+
+      if ((fd = open(expect, O_RDONLY)) < 0 || read(fd, golden, size) != size)
+        {
+          fprintf(stderr, "%s: no %dx%d rgb file\n", expect, r.panel.w, r.panel.h);
+          ret = 2;
+        }
+      else
+        {
+          for (i = 0; i < size; i++)
+            if (r.frame[i] != golden[i] && n++ == 0)
+              first = i / 3;
+          if (n)
+            {
+              fprintf(stderr, "replay: %d of %d bytes differ from %s, first at %d,%d\n",
+                      n, size, expect, first % r.panel.w, first / r.panel.w);
+              ret = 1;
+            }
+          else
+            fprintf(stderr, "replay: frame matches %s\n", expect);
+        }
+      if (fd >= 0)
+        close(fd);
+      free(golden);
+    }
+  free(r.frame);
+  return ret;
+}
+
+
+int main(int ac, char **av)
+{
+  if (av[1] && !strcmp(av[1], "--bench-blit"))
+    return vnc_blt_bench();
+  if (!av[1])
+    {
+      fprintf(stderr,
+"vnc_tiny_view connects your Arietta ledpanel to a remote X-Server.\n\
+\n\
+Usage:\n\
+  # On the X-Server HOST run a VNC server e.g. like this:\n\
+  x11vnc -clip 640x480x0x0 -cursor none -loop\n\
+\n\
+  # On Arietta:\n\
+  VNC_TINY_CFG=/tmp/fifo %s HOST [5900] &\n\
+\n\
+  # To reposition the viewport:\n\
+  echo 100 100 > /tmp/fifo\n\
+\n\
+  # Or change anything at runtime through a control socket:\n\
+  VNC_TINY_CTL=/tmp/vnc.ctl %s HOST &\n\
+  echo 'set view 320x240+0+0; set refresh 100; get stats' | socat - UNIX-CONNECT:/tmp/vnc.ctl\n\
+\n\
+  # Show a larger region averaged down to the panel:\n\
+  VNC_TINY_VIEW=320x240+0+0 %s HOST\n\
+  echo 100 100 160 160 > /tmp/fifo\n\
+\n\
+  # Several servers side by side on a 64x32 wall of two panels:\n\
+  VNC_TINY_PANEL=64x32 %s -m HOST1/320x240+0+0@32x32+0+0 HOST2:5901@32x32+32+0\n\
+\n\
+  # While a server is unreachable, the last frame stays on the panel,\n\
+  # or an animation of 32x32 *.rgb files plays (e.g. ../fire):\n\
+  VNC_TINY_OFFLINE=../fire %s HOST\n\
+\n\
+  # Or show raw video frames from a pipe or file (default: stdin):\n\
+  ffmpeg -i movie.mp4 -f rawvideo -pix_fmt yuv420p -s 160x120 - | %s -i 160x120:yuv420p@25\n\
+\n\
+  # Without a panel, a model of its refresh and write time (or file:PATH, shm:PATH):\n\
+  LEDPANEL=emu:100,1000 %s HOST\n\
+\n\
+  # Record a session, then replay it as fast as it decodes and compare the last frame:\n\
+  VNC_TINY_RECORD=session.vnc %s HOST\n\
+  LEDPANEL=null %s --replay session.vnc --expect golden.rgb\n\
+\n\
+  # Latency from the X-Server to the panel, with ../latency_probe.py 320x240+0+0 on HOST:\n\
+  VNC_TINY_VIEW=320x240+0+0 VNC_TINY_PROBE=100 %s HOST\n\
+\n\
+  # Speed of the pixel format conversions:\n\
+  %s --bench-blit\n", av[0], av[0], av[0], av[0], av[0], av[0], av[0], av[0], av[0], av[0], av[0]);
+      exit(0);
+    }
+
+  struct draw_ledpanel_data draw_ledpanel_data;
+  VncTty tty;
+  VncExposeFunc expose_cb;
+  void *expose_cb_data = NULL;
+
+  VncView panel = { 0, 0, 32, 32, 0 };
+  if (getenv("VNC_TINY_PANEL"))
+    sscanf(getenv("VNC_TINY_PANEL"), "%dx%d", &panel.w, &panel.h);
+
+  draw_ledpanel_data.lut = NULL;
+#ifdef USE_GAMMA_LUT
+  // with only 7 values, all on the bright side, gamma correction is hard.
+  draw_ledpanel_data.lut = mkgamma_lut(8,8,8);
+  draw_ledpanel_data.gamma[0] = draw_ledpanel_data.gamma[1] = draw_ledpanel_data.gamma[2] = 8;
+#endif
+  draw_ledpanel_data.led = NULL;
+  draw_ledpanel_data.led_size = 0;
+  draw_ledpanel_data.out = getenv("VNC_TINY_STDOUT") ? NULL : ledpanel_open(NULL);
+  if (!draw_ledpanel_data.out)
+    {
+      vnc_tty_init(&tty, 1, getenv("VNC_TINY_STDOUT") ? getenv("VNC_TINY_STDOUT") : "1");
+      expose_cb = draw_ascii_art;
+      expose_cb_data = (void *)&tty;
+    }
+  else
+    {
+      expose_cb = draw_ledpanel;
+      expose_cb_data = (void *)&draw_ledpanel_data;
+    }
+
+  if (!strcmp(av[1], "-m"))
+    {
+      VncMosaic mosaic;
+      VncMosaicTile *tiles = (VncMosaicTile *)calloc(ac, sizeof(VncMosaicTile));
+      int i;
+
+      memset(&mosaic, 0, sizeof(mosaic));
+      mosaic.panel = panel;
+      mosaic.rgb = (unsigned char *)calloc(3 * panel.w, panel.h);
+      mosaic.expose_cb = expose_cb;
+      mosaic.expose_cb_data = expose_cb_data;
+      mosaic.out = draw_ledpanel_data.out;
+      for (i = 2; i < ac; i++)
+        {
+          VncConnection *conn = vnc_mosaic_add(&mosaic, &tiles[i-2], av[i]);
+          if (!conn)
+            exit(2);
+          if (getenv("VNC_TINY_OFFLINE"))
+            vnc_connection_set_offline(conn, getenv("VNC_TINY_OFFLINE"));
+          if (getenv("VNC_TINY_STATE"))
+            {
+              char *path = (char *)malloc(strlen(getenv("VNC_TINY_STATE")) + 16);
+              sprintf(path, "%s.%d", getenv("VNC_TINY_STATE"), i-2);
+              vnc_state_init(tiles[i-2].state = (VncState *)calloc(1, sizeof(VncState)), conn, path);
+            }
+        }
+      if (!vnc_mosaic_run(&mosaic, tiles, ac-2))
+        return 1;
+      for (i = 0; i < ac-2; i++)
+        if (tiles[i].state && tiles[i].state->changed)
+          vnc_state_save(tiles[i].state);
+      return 0;
+    }
+
+  if (!strcmp(av[1], "-i"))
+    {
+      VncIngest ingest;
+      int fd = 0;
+
+      if (!av[2]) { fprintf(stderr, "-i needs a frame spec WxH[:rgb24|yuv420p][@fps]\n"); exit(1); }
+      if (av[3] && strcmp(av[3], "-") && (fd = open(av[3], O_RDONLY)) < 0)
+        {
+          perror(av[3]);
+          exit(1);
+        }
+      if (!vnc_ingest_init(&ingest, fd, av[2], panel.w, panel.h)) exit(1);
+      return vnc_ingest_run(&ingest, &panel, expose_cb, expose_cb_data) ? 0 : 1;
+    }
+
+  int replay = !strcmp(av[1], "--replay");
+  if (replay && !av[2])
+    {
+      fprintf(stderr, "--replay needs a VNC_TINY_RECORD file\n");
+      exit(2);
+    }
+
+#if 1
+  VncConnection *conn = connect_vnc_server(replay ? av[2] : av[1], replay ? NULL : av[2]);	// hostname [port]
+  conn->panel = panel;
+  conn->view.x = 0;
+  conn->view.y = 0;
+  conn->view.w = panel.w;
+  conn->view.h = panel.h;
+  if (getenv("VNC_TINY_VIEW"))
+    {
+      // x11vnc style geometry: WxH[+X+Y], averaged down to the panel.
+      sscanf(getenv("VNC_TINY_VIEW"), "%dx%d+%d+%d", &conn->view.w, &conn->view.h, &conn->view.x, &conn->view.y);
+    }
+  if (getenv("VNC_TINY_OFFLINE") && !vnc_connection_set_offline(conn, getenv("VNC_TINY_OFFLINE")))
+    fprintf(stderr, "VNC_TINY_OFFLINE: no %dx%d *.rgb frames in %s\n", panel.w, panel.h, getenv("VNC_TINY_OFFLINE"));
+  conn->expose_cb = expose_cb;
+  conn->expose_cb_data = expose_cb_data;
+  if (replay)
+    {
+      char *expect = NULL, *save = NULL;
+      int i;
+
+      for (i = 3; i + 1 < ac; i += 2)
+        if (!strcmp(av[i], "--expect"))
+          expect = av[i+1];
+        else if (!strcmp(av[i], "--save"))
+          save = av[i+1];
+      return vnc_connection_replay(conn, av[2], expect, save);
+    }
+  if (getenv("VNC_TINY_PROBE"))
+    {
+      VncProbe *probe = (VncProbe *)calloc(1, sizeof(VncProbe));
+      probe->expose_cb = conn->expose_cb;
+      probe->expose_cb_data = conn->expose_cb_data;
+      probe->every = atoi(getenv("VNC_TINY_PROBE")) > 0 ? atoi(getenv("VNC_TINY_PROBE")) : 100;
+      probe->last = -1;
+      conn->expose_cb = vnc_probe_expose;
+      conn->expose_cb_data = (void *)probe;
+    }
+  VncState *state = NULL;
+  if (getenv("VNC_TINY_STATE"))
+    vnc_state_init(state = (VncState *)calloc(1, sizeof(VncState)), conn, getenv("VNC_TINY_STATE"));
+  if (getenv("VNC_TINY_RECORD") &&
+      (conn->record = open(getenv("VNC_TINY_RECORD"), O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+    perror(getenv("VNC_TINY_RECORD"));
+  if (getenv("VNC_TINY_CFG") || getenv("VNC_TINY_CTL"))
+    {
+      VncCtl *ctl = (VncCtl *)calloc(1, sizeof(VncCtl));
+      vnc_ctl_init(ctl, conn, getenv("VNC_TINY_CTL"), getenv("VNC_TINY_CFG"));
+      if (expose_cb == draw_ascii_art)
+        ctl->tty = &tty;
+      else
+        ctl->led = &draw_ledpanel_data;
+    }
+
+  if (getenv("VNC_TINY_PAN") && !vnc_connection_set_pan(conn, strdup(getenv("VNC_TINY_PAN"))))
+    fprintf(stderr, "VNC_TINY_PAN: expected X,Y[@MS] ... [loop]\n");
+
+  // (re)connects whenever vnc_connection_server_message() fails.
+  while (!vnc_state_quit)
+    {
+      if (vnc_connection_server_message(conn))
+        ledpanel_flush(draw_ledpanel_data.out);	// LEDPANEL_POWER, a still screen brightens up again
+      else
+        vnc_ctl_wait(conn->ctl, vnc_connection_offline(conn));
+      vnc_state_check(state);
+    }
+  if (state && state->changed)
+    vnc_state_save(state);
+  return 0;
 
 #else
 